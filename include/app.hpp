@@ -105,6 +105,10 @@ struct ModuleWidget : OpaqueWidget {
 
 	void draw(NVGcontext *vg) override;
 	void drawShadow(NVGcontext *vg);
+	/** Overlays the module's CPU time, see gCpuMeter */
+	void drawCpuMeter(NVGcontext *vg);
+	/** Overlays the module's denormal counts, see gDenormalMeter */
+	void drawDenormalMeter(NVGcontext *vg);
 
 	Vec dragPos;
 	void onMouseDown(EventMouseDown &e) override;
@@ -73,4 +73,13 @@ struct AudioIO {
 };
 
 
+/** When enabled, AudioIO never opens devices. Every stream is captured by audioProcessOffline() instead, at the engine sample rate.
+Must be set before any AudioIO is created.
+*/
+void audioSetOffline(bool offline);
+bool audioIsOffline();
+/** Calls processStream() of the first open stream with a stereo output buffer. Returns false if there is no open stream. */
+bool audioProcessOffline(float *output, int frames);
+
+
 } // namespace rack
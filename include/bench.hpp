@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+
+namespace rack {
+
+
+struct BenchOptions {
+	/** Comma separated list of graphs to run, out of "fanout", "chain", "dag", and "ring" */
+	std::string graphs = "fanout,chain,dag,ring";
+	/** Number of modules in each graph */
+	int modules = 64;
+	/** Wall clock time spent on each measurement */
+	float seconds = 1.f;
+	float sampleRate = 44100.f;
+	std::vector<int> blockSizes = {16, 32, 64, 128, 256, 1024};
+	/** Starts each block when an audio device would ask for it instead of right after the previous one, so idle and spinning threads are accounted for like in a real session */
+	bool paced = false;
+	/** Registers a ModuleBatch kernel for the placeholder modules, so the "mt" rows measure cross-instance SIMD batching */
+	bool batch = false;
+	/** Worker counts to compare. Empty uses 1, 2, 4, ... up to the number of hardware threads. */
+	std::vector<int> threadCounts;
+};
+
+/** Builds synthetic patches out of placeholder modules and measures engineStep() and engineStepMT() on them, printing a table to stdout.
+Requires engineInit(), and that no other patch is loaded.
+*/
+void benchRun(const BenchOptions &options);
+
+
+} // namespace rack
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string.h>
+#include <atomic>
 #include "util/common.hpp"
 
 
@@ -197,4 +198,48 @@ struct AppleRingBuffer {
 	}
 };
 
+/** A cyclic buffer for one producer and one consumer thread, which publishes its contents through atomics instead of locks.
+S must be a power of 2.
+*/
+template <typename T, size_t S>
+struct AtomicRingBuffer {
+	T data[S];
+	std::atomic<size_t> start;
+	std::atomic<size_t> end;
+
+	AtomicRingBuffer() : start(0), end(0) {}
+
+	size_t mask(size_t i) const {
+		return i & (S - 1);
+	}
+	/** Called by the producer. `n` must not exceed capacity(). */
+	void pushBuffer(const T *t, size_t n) {
+		size_t e = end.load(std::memory_order_relaxed);
+		size_t i = mask(e);
+		size_t n1 = (i + n < S) ? n : S - i;
+		memcpy(&data[i], t, sizeof(T) * n1);
+		memcpy(data, t + n1, sizeof(T) * (n - n1));
+		end.store(e + n, std::memory_order_release);
+	}
+	/** Called by the consumer. `n` must not exceed size(). */
+	void shiftBuffer(T *t, size_t n) {
+		size_t s = start.load(std::memory_order_relaxed);
+		size_t i = mask(s);
+		size_t n1 = (i + n < S) ? n : S - i;
+		memcpy(t, &data[i], sizeof(T) * n1);
+		memcpy(t + n1, data, sizeof(T) * (n - n1));
+		start.store(s + n, std::memory_order_release);
+	}
+	/** Called by the consumer */
+	void clear() {
+		start.store(end.load(std::memory_order_acquire), std::memory_order_release);
+	}
+	size_t size() const {
+		return end.load(std::memory_order_acquire) - start.load(std::memory_order_acquire);
+	}
+	size_t capacity() const {
+		return S - size();
+	}
+};
+
 } // namespace rack
@@ -1,5 +1,6 @@
 #pragma once
 #include <vector>
+#include <atomic>
 #include "util/common.hpp"
 #include <jansson.h>
 
@@ -29,8 +30,15 @@ struct Input {
 	float value = 0.0;
 	/** Whether a wire is plugged in */
 	bool active = false;
-	float queue[8192];
-	int pos;
+	/** Samples of the frames passed to Module::process(), the connected Output's block delayed by one sample.
+	Points to silence while not plugged in. Read-only, owned by the engine.
+	*/
+	const float *block = NULL;
+	/** Whether every sample of the block is the same, so block-aware modules can skip work which only depends on this input.
+	Set by the engine before Module::process() from Output::constant, always true while not plugged in.
+	Only checked for pure modules and modules which set Module::readsConstant, always false otherwise while plugged in.
+	*/
+	bool constant = true;
 	Light plugLights[2];
 	/** Returns the value if a wire is plugged in, otherwise returns the given default value */
 	float normalize(float normalValue) {
@@ -43,21 +51,74 @@ struct Wire;
 struct Output {
 	/** Voltage of the port. Write-only by Module */
 	float value = 0.0;
-	float queue[8192];
+	/** Where Module::process() writes the samples of its frames. Read in place by every connected Input.
+	May be NULL while not plugged in, in which case nothing needs to be written. Owned by the engine.
+	*/
+	float *block = NULL;
+	/** Block storage of the engine, where queue[0] is the last sample of the previous block and block == queue + 1 during engineStepMT() */
+	float *queue = NULL;
 	/** Whether a wire is plugged in */
 	bool active = false;
+	/** Whether every sample of the last block read by the connected inputs is the same.
+	Set by the engine once the module is processed, only while a connected module reads Input::constant.
+	*/
+	bool constant = false;
 	Light plugLights[2];
 	std::vector<Wire*> wires;
 };
 
 
+struct ModuleBatch;
+
 struct Module {
 	std::vector<Param> params;
 	std::vector<Input> inputs;
 	std::vector<Output> outputs;
 	std::vector<Light> lights;
-	/** For CPU usage meter */
+	/** For CPU usage meter, the smoothed fraction of the block duration spent stepping this module. Only updated while gCpuMeter is enabled. */
 	float cpuTime = 0.0;
+	/** Recent peak of cpuTime, decays over a few seconds */
+	float cpuPeak = 0.0;
+	/** For denormal diagnostics, the number of denormal samples found in the blocks of the connected inputs and outputs.
+	Only a fraction of the blocks is checked, while gDenormalMeter is enabled.
+	*/
+	int denormalInputs = 0;
+	int denormalOutputs = 0;
+	/** Set by modules which do more than write their outputs, like exchanging audio or MIDI with a device.
+	The engine suspends suspendable modules whose outputs don't lead to a module without outputs or with side effects.
+	*/
+	bool sideEffects = false;
+	/** Set by modules which may stop being stepped while their outputs aren't heard, because they have no display or state which must keep running, like a sequencer position or an LFO phase.
+	Pure modules are suspendable too. Modules with lights are always stepped, so their lights keep up.
+	*/
+	bool suspendable = false;
+	/** Set by modules whose outputs are a function of their current inputs and params only, without internal state.
+	While all inputs are constant, the engine then processes a single frame per block and holds the outputs for the rest.
+	*/
+	bool pure = false;
+	/** Set by block-aware modules which read Input::constant, so the engine checks the outputs feeding them */
+	bool readsConstant = false;
+	/** Kernel which processes this module together with other instances of its model, set by Model::create() from Model::batch.
+	The module must still implement process() or step(), which the engine calls outside of batches.
+	*/
+	const ModuleBatch *batch = NULL;
+	/** Bit `i` is set while input or output `i` is connected, see onPortChange(). Ports past the 64th only have Input::active and Output::active. */
+	uint64_t connectedInputs = 0;
+	uint64_t connectedOutputs = 0;
+	/** Number of quality levels the module offers, like oversampling factors or voice counts. Set in the constructor to take part in gAdaptiveQuality. */
+	int qualityLevels = 1;
+	/** Current level, from 0 for full quality to qualityLevels - 1 for the cheapest. Set by the engine between blocks, see onQualityChange(). */
+	int quality = 0;
+	/** Whether the engine skips the module, see engineSetModuleBypass() */
+	bool bypassed = false;
+	struct BypassRoute {
+		int inputId;
+		int outputId;
+	};
+	/** Inputs which are passed straight to an output while the module is bypassed, like the audio path of an effect. The other outputs act as unplugged. Set in the constructor. */
+	std::vector<BypassRoute> bypassRoutes;
+	/** Whether the engine's current graph steps the module, so param changes go through the queue. Owned by the engine. */
+	std::atomic<bool> stepped{false};
 	bool act;
 	int curstep;
 
@@ -75,8 +136,23 @@ struct Module {
 	/** Advances the module by 1 audio frame with duration 1.0 / gSampleRate */
 	virtual void step() {}
 
+	struct ProcessArgs {
+		float sampleRate;
+		float sampleTime;
+	};
+	/** Advances the module by `frames` audio frames, reading Input::block and writing Output::block.
+	Override to process whole blocks at once. The default implementation calls step() for every frame, moving the samples through Input::value and Output::value.
+	*/
+	virtual void process(const ProcessArgs &args, int frames);
+
 	/** Called when the engine sample rate is changed */
 	virtual void onSampleRateChange() {}
+	/** Called when connectedInputs or connectedOutputs change, between two blocks so process() can rely on them for the whole block.
+	Use it to pick code paths once, like mono or stereo, instead of checking the ports every frame. Blocks the engine, so keep it short.
+	*/
+	virtual void onPortChange() {}
+	/** Called when the engine changes `quality` to save CPU time or because there is headroom again, between two blocks */
+	virtual void onQualityChange() {}
 	/** Called when module is created by the Add Module popup, cloning, or when loading a patch or autosave */
 	virtual void onCreate() {}
 	/** Called when user explicitly deletes the module, not when Rack is closed or a new patch is loaded */
@@ -102,28 +178,130 @@ struct Module {
 	virtual void randomize() {}
 };
 
+/** A kernel which processes several instances of a module type at once, for example with one SIMD lane per module.
+The engine groups the instances which share a kernel and don't depend on each other within a block, and calls it instead of Module::process().
+*/
+struct ModuleBatch {
+	/** Advances `count` modules by `frames` frames, reading and writing their port blocks like Module::process() */
+	void (*process)(Module **modules, int count, const Module::ProcessArgs &args, int frames) = NULL;
+	/** Largest number of modules per call, such as the SIMD width */
+	int size = 4;
+};
+
 struct Wire {
 	Module *outputModule = NULL;
 	int outputId;
 	Module *inputModule = NULL;
 	int inputId;
 	void step();
-	void stepMultiple(int steps);
 };
 
 void engineInit();
 void engineDestroy();
+/** Resizes the worker pool, waiting for the running block to finish. 0 uses one worker per hardware thread but one, which is left to the audio thread. */
+void engineSetThreadCount(int count);
+/** Returns the number of running workers */
+int engineGetThreadCount();
+
+/** Real-time setup of the engine's worker threads and memory */
+struct EngineThreadConfig {
+	enum Policy {
+		/** Normal time-sharing scheduling, priority is ignored */
+		POLICY_OTHER,
+		POLICY_RR,
+		POLICY_FIFO,
+	};
+	Policy policy = POLICY_RR;
+	int priority = 15;
+	/** CPU mask of each worker, where bit i allows CPU i. Worker n uses cpuMasks[n % cpuMasks.size()].
+	Empty lets the OS migrate the workers. Only supported on Linux.
+	*/
+	std::vector<uint64_t> cpuMasks;
+	/** Locks the process memory into RAM with mlockall(), again after each patch edit for the memory of new modules */
+	bool lockMemory = false;
+	/** Touches the worker stacks and reserves the engine's scratch buffers up front, so they don't page fault or allocate during a block */
+	bool prefault = false;
+	/** Seconds the workers and engineWaitMT() spin before sleeping while they wait for each other.
+	Spinning for longer than a block keeps the workers awake in between blocks, at the cost of busy cores.
+	*/
+	float spinTime = 20e-6f;
+
+	bool operator==(const EngineThreadConfig &other) const {
+		return policy == other.policy && priority == other.priority && cpuMasks == other.cpuMasks && lockMemory == other.lockMemory && prefault == other.prefault && spinTime == other.spinTime;
+	}
+	bool operator!=(const EngineThreadConfig &other) const {
+		return !(*this == other);
+	}
+};
+/** Restarts the workers with the given config, waiting for the running block to finish */
+void engineSetThreadConfig(const EngineThreadConfig &config);
+EngineThreadConfig engineGetThreadConfig();
+
+/** Timing of the block handoff between engineStepMT(), the workers and engineWaitMT() */
+struct EngineBarrierStats {
+	/** Smoothed and peak delay in seconds between the start of a block and the last worker waking up for it */
+	float wakeLatency = 0.f;
+	float wakeLatencyPeak = 0.f;
+	/** Smoothed and peak delay in seconds between the last worker finishing a block and engineWaitMT() returning */
+	float completionLatency = 0.f;
+	float completionLatencyPeak = 0.f;
+	/** Smoothed fraction of the waits which had to sleep because spinning wasn't enough */
+	float parkRatio = 0.f;
+};
+EngineBarrierStats engineGetBarrierStats();
+
+/** Block load seen by the adaptive quality monitor, see gAdaptiveQuality */
+struct EngineLoadStats {
+	/** Smoothed time to compute a block, as a fraction of the block duration */
+	float load = 0.f;
+	/** Blocks which took longer than their duration */
+	int deadlineMisses = 0;
+	/** Quality levels currently taken away from modules */
+	int degradedLevels = 0;
+};
+EngineLoadStats engineGetLoadStats();
 /** Launches engine thread */
 void engineStart();
 void engineStop();
+/** Groups the following module and wire edits until the matching engineCommitTransaction(), so the engine switches to the edited patch at once.
+Modules and wires removed in a transaction are stepped until it is committed, so they must not be deleted before, see engineDeleteModule() and engineDeleteWire().
+Transactions can be nested, only the outermost commit takes effect.
+*/
+void engineBeginTransaction();
+/** Compiles the edited patch while the engine keeps running and swaps it in between two blocks */
+void engineCommitTransaction();
 /** Does not transfer pointer ownership */
 void engineAddModule(Module *module);
 void engineRemoveModule(Module *module);
+/** Removes the module and deletes it once the engine no longer steps it, which is at the end of the transaction */
+void engineDeleteModule(Module *module);
+/** Stops or resumes stepping the module, leaving its state as it was. Its bypass routes connect the wires into it to the wires out of it. */
+void engineSetModuleBypass(Module *module, bool bypassed);
+/** Sinks, like audio and MIDI interfaces, can't be bypassed because their devices would keep playing their last block */
+bool engineCanBypassModule(Module *module);
 /** Does not transfer pointer ownership */
 void engineAddWire(Wire *wire);
 void engineRemoveWire(Wire *wire);
-void engineSetParam(Module *module, int paramId, float value);
-void engineSetParamSmooth(Module *module, int paramId, float value);
+/** Removes the wire and deletes it at the end of the transaction */
+void engineDeleteWire(Wire *wire);
+/** Queues a param change from any thread without blocking the engine.
+It is set at the start of the next block, or `frame` frames into it for sample-accurate automation. Changes past the end of the block are carried over to the following ones.
+Modules which aren't stepped, like modules being loaded, are set right away on the calling thread.
+*/
+void engineSetParam(Module *module, int paramId, float value, int frame = 0);
+/** Queues a param change which is reached linearly over `rampTime` seconds, one graphics frame by default.
+Any number of params can be ramped at once. A ramp started while the param is still ramping continues from its current value.
+Modules which aren't stepped are set to the value right away.
+*/
+void engineSetParamSmooth(Module *module, int paramId, float value, float rampTime = 1.f / 60.f);
+/** Sets the queued param changes and ramps of the module to their final values, waiting for the running block.
+For code which reads the params right after setting them, like Module::onReset().
+*/
+void engineFlushParams(Module *module);
+/** Reports input which must be heard right away, like MIDI or audio input. Param changes and patch edits are reported by the engine itself. Thread-safe. */
+void engineNotifyLive();
+/** Number of live events reported so far. Audio drivers which render ahead of the device poll it to drop back to low latency. */
+unsigned engineGetLiveCount();
 void engineSetSampleRate(float sampleRate);
 float engineGetSampleRate();
 /** Returns the inverse of the current sample rate */
@@ -132,8 +310,18 @@ float engineGetSampleTime();
 void engineStep();
 void engineStepMT(int steps);
 void engineWaitMT();
+/** Waits at most `timeout` seconds for the block started by engineStepMT() and returns whether it finished.
+If not, the block keeps running and engineWaitMT() must be called before the next engineStepMT().
+*/
+bool engineWaitMTFor(float timeout);
 
 extern bool gPaused;
+/** Enables per-module CPU time measurement in engineStepMT(), see Module::cpuTime */
+extern bool gCpuMeter;
+/** Enables sampled counting of denormal samples in engineStepMT(), see Module::denormalInputs */
+extern bool gDenormalMeter;
+/** Lowers Module::quality on the heaviest modules while blocks of engineStepMT() get close to their deadline, and restores it once there is headroom */
+extern bool gAdaptiveQuality;
 /** Plugins should not manipulate other modules or wires unless that is the entire purpose of the module.
 Your plugin needs to have a clear purpose for manipulating other modules and wires and must be done with a good UX.
 */
@@ -2,6 +2,7 @@
 #include <string>
 #include <list>
 #include "tags.hpp"
+#include "engine.hpp"
 
 
 namespace rack {
@@ -56,6 +57,8 @@ struct Model {
 	std::string author;
 	/** List of tags representing the function(s) of the module (optional) */
 	std::list<ModelTag> tags;
+	/** Optional kernel which processes several instances of the module at once. Set `batch.process` after creating the Model. */
+	ModuleBatch batch;
 
 	virtual ~Model() {}
 	/** Creates a headless Module */
@@ -71,10 +74,14 @@ struct Model {
 		struct TModel : Model {
 			Module *createModule() override {
 				TModule *module = new TModule();
+				if (batch.process)
+					module->batch = &batch;
 				return module;
 			}
 			ModuleWidget *createModuleWidget() override {
 				TModule *module = new TModule();
+				if (batch.process)
+					module->batch = &batch;
 				TModuleWidget *moduleWidget = new TModuleWidget(module);
 				moduleWidget->model = this;
 				return moduleWidget;
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <string>
+
+
+namespace rack {
+
+
+/** Loads a patch without a window and runs the engine faster than realtime, writing the output of its first audio interface to a 32-bit float stereo WAV file.
+Requires pluginInit() and engineInit(), and audioSetOffline(true) before the patch is loaded.
+Returns false if the patch could not be loaded, has no audio interface, or the WAV file could not be written.
+*/
+bool renderPatch(std::string patchPath, std::string wavPath, float sampleRate, long frames, int blockSize);
+
+
+} // namespace rack
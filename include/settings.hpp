@@ -17,6 +17,8 @@ extern bool skipAutosaveOnLaunch;
 extern bool largerHitBoxes;
 extern bool lockModules;
 extern float knobSensitivity;
+/** Number of engine worker threads, 0 for one per hardware thread but one */
+extern int threadCount;
 
 extern std::string lastDialogPath;
 
@@ -42,6 +42,7 @@ struct AudioInterfaceIO : AudioIO {
 		}
 
 		if (numInputs > 0) {
+			engineNotifyLive();
 			// TODO Do we need to wait on the input to be consumed here? Experimentally, it works fine if we don't.
 			for (int i = 0; i < frames; i++) {
 				if (inputBuffer.full())
@@ -133,6 +134,7 @@ struct AudioInterface : Module {
 	DoubleRingBuffer<Frame<AUDIO_OUTPUTS>, 16> outputBuffer;
 
 	AudioInterface() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS) {
+		sideEffects = true;
 		onSampleRateChange();
 	}
 
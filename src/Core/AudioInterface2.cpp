@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <atomic>
 #include <mutex>
 #include <chrono>
 #include <thread>
@@ -39,20 +40,227 @@ struct AudioInterfaceIO2 : AudioIO {
 	float *bufEnd = buf+(1<<16);
 	volatile bool bufReady = false;
 	bool active = false;
+	/** Computes each block in the callback that outputs it instead of one callback ahead, which saves a block of latency.
+	After a block misses the deadline, the stream is pipelined for a second before trying again.
+	*/
+	bool sync = false;
+	/** Fraction of the block duration the callback waits for the block in sync mode */
+	float syncDeadline = 0.5f;
+	/** Whether sync mode fell back to pipelining, and for how many more blocks */
+	bool fallback = false;
+	int fallbackBlocks = 0;
+	/** Whether buf holds a block which wasn't output yet */
+	bool pending = false;
+	/** Whether the pending block is the one which missed the sync deadline, so it's not counted as a pipelined miss */
+	bool pendingLate = false;
+	/** Frames of latency added on top of the device buffer, either 0 or one block */
+	int latency = 0;
+	/** Blocks which missed the deadline in sync mode, and blocks which weren't finished by the next callback in pipelined mode */
+	int syncMisses = 0;
+	int pipelinedMisses = 0;
+
+	/** Lets the engine run far ahead of the device in large blocks while nobody plays the patch live, see engineGetLiveCount().
+	Any live event drops back to stepping the engine from the audio thread.
+	*/
+	std::atomic<bool> renderAhead{false};
+	enum AheadState {
+		/** The audio thread steps the engine */
+		AHEAD_OFF,
+		/** renderThread steps the engine and fills aheadBuffer */
+		AHEAD_RUNNING,
+		/** renderThread finishes its block before handing the engine back */
+		AHEAD_STOPPING,
+		/** renderThread is idle, the audio thread takes the engine back at the next callback */
+		AHEAD_STOPPED,
+	};
+	std::atomic<int> aheadState{AHEAD_OFF};
+	/** Interleaved audio rendered by renderThread, consumed by the audio thread */
+	AtomicRingBuffer<float, (1<<15)> aheadBuffer;
+	std::thread renderThread;
+	std::atomic<bool> renderQuit{false};
+	/** Set by renderThread once it has quit, so the audio thread knows nobody else steps the engine */
+	std::atomic<bool> renderExited{true};
+	/** Seconds without live events before rendering ahead */
+	float aheadDelay = 5.f;
+	/** Frames rendered ahead of the device, and the largest block the engine renders them with */
+	int aheadFrames = 8192;
+	int aheadBlockSize = 2048;
+	unsigned lastLiveCount = 0;
+	/** Device frames since the last live event */
+	int quietFrames = 0;
+	/** Callbacks which found aheadBuffer short of a block */
+	int aheadUnderruns = 0;
 	Module *module;
 	AudioWidget *widget;
 
 	~AudioInterfaceIO2() {
 		// Close stream here before destructing AudioInterfaceIO, so the mutexes are still valid when waiting to close.
 		setDevice(-1, 0);
+		if (renderThread.joinable()) {
+			renderQuit = true;
+			engineCv.notify_one();
+			renderThread.join();
+		}
+	}
+
+	void setRenderAhead(bool renderAhead) {
+		this->renderAhead = renderAhead;
+		// Offline renders step the engine from the render loop, which never waits for a device
+		if (renderAhead && !renderThread.joinable() && !audioIsOffline()) {
+			renderQuit = false;
+			renderExited = false;
+			renderThread = std::thread(&AudioInterfaceIO2::renderRun, this);
+		}
+		if (!renderAhead && renderThread.joinable()) {
+			// renderRun() finishes its block before quitting
+			renderQuit = true;
+			engineCv.notify_one();
+			// The audio thread takes the engine back at its next callback, see processAhead()
+			renderThread.join();
+		}
+	}
+
+	/** Steps the engine on behalf of the audio thread while rendering ahead.
+	Starts with device sized blocks after the handover, so the first ones are ready in time, and grows them as the buffer fills.
+	*/
+	void renderRun() {
+		std::unique_lock<std::mutex> lock(engineMutex);
+		while (!renderQuit) {
+			int state = aheadState;
+			if (state == AHEAD_STOPPING) {
+				aheadState = AHEAD_STOPPED;
+				continue;
+			}
+			int buffered = aheadBuffer.size() / 2;
+			if (state != AHEAD_RUNNING || buffered >= aheadFrames) {
+				// Woken after every callback
+				engineCv.wait_for(lock, std::chrono::milliseconds(10));
+				continue;
+			}
+			int frames = clamp(buffered, blockSize, std::max(blockSize, aheadBlockSize));
+			bufPtr = buf;
+			engineStepMT(frames);
+			engineWaitMT();
+			aheadBuffer.pushBuffer(buf, frames * 2);
+		}
+		renderExited = true;
+	}
+
+	/** Outputs the audio rendered ahead and hands the engine over between the threads. Returns false if the audio thread steps the engine. */
+	bool processAhead(float *output, int frames) {
+		unsigned liveCount = engineGetLiveCount();
+		if (liveCount != lastLiveCount) {
+			lastLiveCount = liveCount;
+			quietFrames = 0;
+		}
+		else if (quietFrames < aheadDelay * sampleRate) {
+			quietFrames += frames;
+		}
+		bool quiet = renderAhead && quietFrames >= aheadDelay * sampleRate;
+
+		if (aheadState == AHEAD_OFF) {
+			if (!quiet)
+				return false;
+			// The rendered audio continues after the last block of the audio thread
+			if (!pending) {
+				// Sync mode already output its block, so the next one is computed here
+				bufPtr = buf;
+				engineStepMT(frames);
+			}
+			engineWaitMT();
+			memcpy(output, buf, frames*2*sizeof(float));
+			pending = false;
+			pendingLate = false;
+			fallback = false;
+			aheadBuffer.clear();
+			aheadState = AHEAD_RUNNING;
+			engineCv.notify_one();
+			return true;
+		}
+
+		if (!quiet && aheadState == AHEAD_RUNNING)
+			aheadState = AHEAD_STOPPING;
+		// renderThread quit when render-ahead was disabled, possibly right after this thread handed it the engine
+		if (renderExited)
+			aheadState = AHEAD_STOPPED;
+		if (aheadBuffer.size() >= (size_t) frames*2) {
+			aheadBuffer.shiftBuffer(output, frames*2);
+		}
+		else {
+			memset(output, 0, frames*2*sizeof(float));
+			aheadUnderruns++;
+		}
+		engineCv.notify_one();
+		latency = aheadBuffer.size() / 2;
+
+		if (aheadState == AHEAD_STOPPED) {
+			// renderThread is done, so drop what it rendered ahead to get back to low latency right away
+			aheadState = AHEAD_OFF;
+			aheadBuffer.clear();
+			latency = 0;
+			if (!sync) {
+				bufPtr = buf;
+				engineStepMT(frames);
+				pending = true;
+				latency = frames;
+			}
+		}
+		return true;
 	}
 
 	void processStream(const float *input, float *output, int frames) override {
 #ifndef ARCH_WEB
-		engineWaitMT();
+		// Also hands the engine back once render-ahead is disabled
+		if ((renderAhead || aheadState != AHEAD_OFF) && !audioIsOffline() && processAhead(output, frames))
+			return;
+		// Offline renders expect the pipelined delay and never miss a deadline
+		if (sync && !fallback && !audioIsOffline()) {
+			if (pending) {
+				// Output the block left by pipelined mode so no audio is skipped, the next callback computes its own block
+				engineWaitMT();
+				memcpy(output, buf, frames*2*sizeof(float));
+				pending = false;
+				latency = 0;
+				return;
+			}
+			bufPtr = buf;
+			engineStepMT(frames);
+			if (engineWaitMTFor(syncDeadline * frames / sampleRate)) {
+				memcpy(output, buf, frames*2*sizeof(float));
+				pending = false;
+				latency = 0;
+				return;
+			}
+			// Output silence and let the block finish for the next callback, as in pipelined mode
+			syncMisses++;
+			memset(output, 0, frames*2*sizeof(float));
+			pending = true;
+			pendingLate = true;
+			latency = frames;
+			fallback = true;
+			fallbackBlocks = std::max(sampleRate / frames, 1);
+			return;
+		}
+
+		if (!engineWaitMTFor(0.f)) {
+			if (!pendingLate)
+				pipelinedMisses++;
+			engineWaitMT();
+		}
+		pendingLate = false;
+		if (!pending) {
+			// Nothing was computed ahead, like right after sync mode, so compute this block now instead of outputting silence
+			bufPtr = buf;
+			engineStepMT(frames);
+			engineWaitMT();
+		}
 		memcpy(output, buf, frames*2*sizeof(float));
 		bufPtr = buf;
 		engineStepMT(frames);
+		pending = true;
+		latency = frames;
+		if (fallback && --fallbackBlocks <= 0)
+			fallback = false;
 #else		
 		bufPtr = output;
 		for (int i = 0; i < frames; i++)
@@ -105,6 +313,7 @@ struct AudioInterface2 : Module {
 	DoubleRingBuffer<Frame<AUDIO_OUTPUTS>, 16> outputBuffer;
 
 	AudioInterface2() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS) {
+		sideEffects = true;
 		audioIO.module = this;
 	}
 
@@ -112,17 +321,25 @@ struct AudioInterface2 : Module {
 		audioIO.module = NULL;
 	}
 
-	void step() override;
+	void process(const ProcessArgs &args, int frames) override;
 
 	json_t *toJson() override {
 		json_t *rootJ = json_object();
 		json_object_set_new(rootJ, "audio", audioIO.toJson());
+		json_object_set_new(rootJ, "sync", json_boolean(audioIO.sync));
+		json_object_set_new(rootJ, "renderAhead", json_boolean(audioIO.renderAhead));
 		return rootJ;
 	}
 
 	void fromJson(json_t *rootJ) override {
 		json_t *audioJ = json_object_get(rootJ, "audio");
 		audioIO.fromJson(audioJ);
+		json_t *syncJ = json_object_get(rootJ, "sync");
+		if (syncJ)
+			audioIO.sync = json_boolean_value(syncJ);
+		json_t *renderAheadJ = json_object_get(rootJ, "renderAhead");
+		if (renderAheadJ)
+			audioIO.setRenderAhead(json_boolean_value(renderAheadJ));
 	}
 
 	void onReset() override {
@@ -131,10 +348,15 @@ struct AudioInterface2 : Module {
 };
 
 
-void AudioInterface2::step() {
-	*(audioIO.bufPtr+0) = clamp(inputs[AUDIO_INPUT + 0].value / 10.f, -1.f, 1.f);
-	*(audioIO.bufPtr+1) = clamp(inputs[AUDIO_INPUT + 1].value / 10.f, -1.f, 1.f);
-	audioIO.bufPtr += 2;
+void AudioInterface2::process(const ProcessArgs &args, int frames) {
+	const float *left = inputs[AUDIO_INPUT + 0].block;
+	const float *right = inputs[AUDIO_INPUT + 1].block;
+	float *bufPtr = audioIO.bufPtr;
+	for (int i = 0; i < frames; i++) {
+		bufPtr[2*i + 0] = clamp(left[i] / 10.f, -1.f, 1.f);
+		bufPtr[2*i + 1] = clamp(right[i] / 10.f, -1.f, 1.f);
+	}
+	audioIO.bufPtr += 2 * frames;
 
 	lights[INPUT_LIGHT + 0].value = (/*audioIO.active &&*/ audioIO.numOutputs > 0);
 }
@@ -167,6 +389,42 @@ struct AudioInterfaceWidget2 : ModuleWidget {
 #endif
 	}
 
+	void appendContextMenu(Menu *menu) override {
+		AudioInterface2 *module = dynamic_cast<AudioInterface2*>(this->module);
+		AudioInterfaceIO2 *audioIO = &module->audioIO;
+
+		struct SyncItem : MenuItem {
+			AudioInterfaceIO2 *audioIO;
+			void onAction(EventAction &e) override {
+				audioIO->sync ^= true;
+				audioIO->syncMisses = 0;
+				audioIO->pipelinedMisses = 0;
+			}
+		};
+
+		struct RenderAheadItem : MenuItem {
+			AudioInterfaceIO2 *audioIO;
+			void onAction(EventAction &e) override {
+				audioIO->setRenderAhead(!audioIO->renderAhead);
+				audioIO->aheadUnderruns = 0;
+			}
+		};
+
+		menu->addChild(MenuEntry::create());
+		SyncItem *syncItem = MenuItem::create<SyncItem>("Low latency (sync)", CHECKMARK(audioIO->sync));
+		syncItem->audioIO = audioIO;
+		menu->addChild(syncItem);
+		RenderAheadItem *renderAheadItem = MenuItem::create<RenderAheadItem>("Render ahead while idle", CHECKMARK(audioIO->renderAhead));
+		renderAheadItem->audioIO = audioIO;
+		menu->addChild(renderAheadItem);
+
+		float latency = 1000.f * (audioIO->blockSize + audioIO->latency) / audioIO->sampleRate;
+		menu->addChild(MenuLabel::create(stringf("Latency: %.1f ms (%d + %d frames)", latency, audioIO->blockSize, audioIO->latency)));
+		menu->addChild(MenuLabel::create(stringf("Missed blocks: %d sync, %d pipelined", audioIO->syncMisses, audioIO->pipelinedMisses)));
+		if (audioIO->renderAhead)
+			menu->addChild(MenuLabel::create(stringf("Rendering ahead: %s, %d underruns", audioIO->aheadState != AudioInterfaceIO2::AHEAD_OFF ? "yes" : "no", audioIO->aheadUnderruns)));
+	}
+
 	~AudioInterfaceWidget2() {
 		static_cast<AudioInterface2*>(module)->audioIO.widget = NULL;
 	}
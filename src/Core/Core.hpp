@@ -13,6 +13,12 @@ extern Model *modelMIDITriggerToCVInterface;
 extern Model *modelBlank;
 extern Model *modelNotes;
 
+/** Writes the same value to every frame of an output block, if it is plugged in */
+inline void fillBlock(Output &output, float value, int frames) {
+	if (output.block)
+		std::fill(output.block, output.block + frames, value);
+}
+
 struct GridChoice : LedDisplayChoice {
 	virtual void setId(int id) {}
 };
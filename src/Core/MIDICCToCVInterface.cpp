@@ -27,6 +27,7 @@ struct MIDICCToCVInterface : Module {
 	int learnedCcs[16] = {};
 
 	MIDICCToCVInterface() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS) {
+		sideEffects = true;
 		onReset();
 	}
 
@@ -40,18 +41,24 @@ struct MIDICCToCVInterface : Module {
 		learningId = -1;
 	}
 
-	void step() override {
+	void process(const ProcessArgs &args, int frames) override {
 		MidiMessage msg;
 		while (midiInput.shift(&msg)) {
 			processMessage(msg);
 		}
 
-		float lambda = 100.f * engineGetSampleTime();
+		float lambda = 100.f * args.sampleTime;
 		for (int i = 0; i < 16; i++) {
 			int learnedCc = learnedCcs[i];
 			float value = rescale(clamp(ccs[learnedCc], -127, 127), 0, 127, 0.f, 10.f);
 			ccFilters[i].lambda = lambda;
-			outputs[CC_OUTPUT + i].value = ccFilters[i].process(value);
+			// Keep filtering while unplugged so the output doesn't jump when plugged in
+			float *block = outputs[CC_OUTPUT + i].block;
+			for (int j = 0; j < frames; j++) {
+				float out = ccFilters[i].process(value);
+				if (block)
+					block[j] = out;
+			}
 		}
 	}
 
@@ -58,6 +58,7 @@ struct MIDIToCVInterface : Module {
 	bool gate;
 
 	MIDIToCVInterface() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS), heldNotes(128) {
+		sideEffects = true;
 		onReset();
 	}
 
@@ -139,30 +140,47 @@ struct MIDIToCVInterface : Module {
 		releaseNote(255);
 	}
 
-	void step() override {
+	/** Advances a pulse over the block, writing it to the output if it is plugged in */
+	void processPulse(PulseGenerator &pulse, Output &output, float deltaTime, int frames) {
+		for (int i = 0; i < frames; i++) {
+			float out = pulse.process(deltaTime) ? 10.f : 0.f;
+			if (output.block)
+				output.block[i] = out;
+		}
+	}
+
+	void processFilter(ExponentialFilter &filter, float value, Output &output, float lambda, int frames) {
+		filter.lambda = lambda;
+		for (int i = 0; i < frames; i++) {
+			float out = filter.process(value);
+			if (output.block)
+				output.block[i] = out;
+		}
+	}
+
+	void process(const ProcessArgs &args, int frames) override {
 		MidiMessage msg;
 		while (midiInput.shift(&msg)) {
 			processMessage(msg);
 		}
-		float deltaTime = engineGetSampleTime();
+		float deltaTime = args.sampleTime;
 
-		outputs[CV_OUTPUT].value = (lastNote - 60) / 12.f;
-		outputs[GATE_OUTPUT].value = gate ? 10.f : 0.f;
-		outputs[VELOCITY_OUTPUT].value = rescale(noteData[lastNote].velocity, 0, 127, 0.f, 10.f);
+		// Messages are handled once per block, so these are constant over the block
+		fillBlock(outputs[CV_OUTPUT], (lastNote - 60) / 12.f, frames);
+		fillBlock(outputs[GATE_OUTPUT], gate ? 10.f : 0.f, frames);
+		fillBlock(outputs[VELOCITY_OUTPUT], rescale(noteData[lastNote].velocity, 0, 127, 0.f, 10.f), frames);
+		fillBlock(outputs[AFTERTOUCH_OUTPUT], rescale(noteData[lastNote].aftertouch, 0, 127, 0.f, 10.f), frames);
 
-		outputs[AFTERTOUCH_OUTPUT].value = rescale(noteData[lastNote].aftertouch, 0, 127, 0.f, 10.f);
-		pitchFilter.lambda = 100.f * deltaTime;
-		outputs[PITCH_OUTPUT].value = pitchFilter.process(rescale(pitch, 0, 16384, -5.f, 5.f));
-		modFilter.lambda = 100.f * deltaTime;
-		outputs[MOD_OUTPUT].value = modFilter.process(rescale(mod, 0, 127, 0.f, 10.f));
+		processFilter(pitchFilter, rescale(pitch, 0, 16384, -5.f, 5.f), outputs[PITCH_OUTPUT], 100.f * deltaTime, frames);
+		processFilter(modFilter, rescale(mod, 0, 127, 0.f, 10.f), outputs[MOD_OUTPUT], 100.f * deltaTime, frames);
 
-		outputs[RETRIGGER_OUTPUT].value = retriggerPulse.process(deltaTime) ? 10.f : 0.f;
-		outputs[CLOCK_1_OUTPUT].value = clockPulses[0].process(deltaTime) ? 10.f : 0.f;
-		outputs[CLOCK_2_OUTPUT].value = clockPulses[1].process(deltaTime) ? 10.f : 0.f;
+		processPulse(retriggerPulse, outputs[RETRIGGER_OUTPUT], deltaTime, frames);
+		processPulse(clockPulses[0], outputs[CLOCK_1_OUTPUT], deltaTime, frames);
+		processPulse(clockPulses[1], outputs[CLOCK_2_OUTPUT], deltaTime, frames);
 
-		outputs[START_OUTPUT].value = startPulse.process(deltaTime) ? 10.f : 0.f;
-		outputs[STOP_OUTPUT].value = stopPulse.process(deltaTime) ? 10.f : 0.f;
-		outputs[CONTINUE_OUTPUT].value = continuePulse.process(deltaTime) ? 10.f : 0.f;
+		processPulse(startPulse, outputs[START_OUTPUT], deltaTime, frames);
+		processPulse(stopPulse, outputs[STOP_OUTPUT], deltaTime, frames);
+		processPulse(continuePulse, outputs[CONTINUE_OUTPUT], deltaTime, frames);
 	}
 
 	void processMessage(MidiMessage msg) {
@@ -27,6 +27,7 @@ struct MIDITriggerToCVInterface : Module {
 	bool velocity = false;
 
 	MIDITriggerToCVInterface() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS) {
+		sideEffects = true;
 		onReset();
 	}
 
@@ -64,24 +65,27 @@ struct MIDITriggerToCVInterface : Module {
 		}
 	}
 
-	void step() override {
+	void process(const ProcessArgs &args, int frames) override {
 		MidiMessage msg;
 		while (midiInput.shift(&msg)) {
 			processMessage(msg);
 		}
-		float deltaTime = engineGetSampleTime();
 
 		for (int i = 0; i < 16; i++) {
-			if (gateTimes[i] > 0.f) {
-				outputs[TRIG_OUTPUT + i].value = velocity ? rescale(velocities[i], 0, 127, 0.f, 10.f) : 10.f;
-				// If the gate is off, wait 1 ms before turning the pulse off.
-				// This avoids drum controllers sending a pulse with 0 ms duration.
-				if (!gates[i]) {
-					gateTimes[i] -= deltaTime;
+			float *block = outputs[TRIG_OUTPUT + i].block;
+			float value = velocity ? rescale(velocities[i], 0, 127, 0.f, 10.f) : 10.f;
+			for (int j = 0; j < frames; j++) {
+				float out = 0.f;
+				if (gateTimes[i] > 0.f) {
+					out = value;
+					// If the gate is off, wait 1 ms before turning the pulse off.
+					// This avoids drum controllers sending a pulse with 0 ms duration.
+					if (!gates[i]) {
+						gateTimes[i] -= args.sampleTime;
+					}
 				}
-			}
-			else {
-				outputs[TRIG_OUTPUT + i].value = 0.f;
+				if (block)
+					block[j] = out;
 			}
 		}
 	}
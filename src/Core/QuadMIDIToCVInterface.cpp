@@ -52,6 +52,7 @@ struct QuadMIDIToCVInterface : Module {
 	int stealIndex;
 
 	QuadMIDIToCVInterface() : Module(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS), cachedNotes(128) {
+		sideEffects = true;
 		onReset();
 	}
 
@@ -19,6 +19,8 @@ ModuleWidget::ModuleWidget(Module *module) {
 }
 
 ModuleWidget::~ModuleWidget() {
+	// Remove the wires and the module in a single graph change
+	engineBeginTransaction();
 	// Make sure WireWidget destructors are called *before* removing `module` from the rack.
 	disconnect();
 
@@ -34,10 +36,10 @@ ModuleWidget::~ModuleWidget() {
 
 	// Remove and delete the Module instance
 	if (module) {
-		engineRemoveModule(module);
-		delete module;
+		engineDeleteModule(module);
 		module = NULL;
 	}
+	engineCommitTransaction();
 }
 
 void ModuleWidget::addChild(Widget *widget) {
@@ -125,6 +127,9 @@ json_t *ModuleWidget::toJson() {
 		json_array_append_new(paramsJ, paramJ);
 	}
 	json_object_set_new(rootJ, "params", paramsJ);
+	// bypass
+	if (module && module->bypassed)
+		json_object_set_new(rootJ, "bypass", json_true());
 	// data
 	if (module) {
 		json_t *dataJ = module->toJson();
@@ -203,9 +208,15 @@ void ModuleWidget::fromJson(json_t *rootJ) {
 		}
 	}
 
+	// bypass
+	json_t *bypassJ = json_object_get(rootJ, "bypass");
+	if (bypassJ && module)
+		engineSetModuleBypass(module, json_is_true(bypassJ));
+
 	// data
 	json_t *dataJ = json_object_get(rootJ, "data");
 	if (dataJ && module) {
+		engineFlushParams(module);
 		module->fromJson(dataJ);
 	}
 }
@@ -307,12 +318,14 @@ void ModuleWidget::saveDialog() {
 }
 
 void ModuleWidget::disconnect() {
+	engineBeginTransaction();
 	for (Port *input : inputs) {
 		gRackWidget->wireContainer->removeAllWires(input);
 	}
 	for (Port *output : outputs) {
 		gRackWidget->wireContainer->removeAllWires(output);
 	}
+	engineCommitTransaction();
 }
 
 void ModuleWidget::create() {
@@ -332,6 +345,8 @@ void ModuleWidget::reset() {
 		param->reset();
 	}
 	if (module) {
+		// The module reads the new values of its params
+		engineFlushParams(module);
 		module->onReset();
 	}
 }
@@ -341,6 +356,7 @@ void ModuleWidget::randomize() {
 		param->randomize();
 	}
 	if (module) {
+		engineFlushParams(module);
 		module->onRandomize();
 	}
 }
@@ -359,9 +375,59 @@ void ModuleWidget::draw(NVGcontext *vg) {
 		nvgRestore(vg);
 	}
 
+	// Dim bypassed modules
+	if (module && module->bypassed) {
+		nvgBeginPath(vg);
+		nvgRect(vg, 0, 0, box.size.x, box.size.y);
+		nvgFillColor(vg, nvgRGBAf(0, 0, 0, 0.5));
+		nvgFill(vg);
+	}
+
+	if (gCpuMeter && module)
+		drawCpuMeter(vg);
+	if (gDenormalMeter && module && (module->denormalInputs > 0 || module->denormalOutputs > 0))
+		drawDenormalMeter(vg);
+
 	nvgResetScissor(vg);
 }
 
+void ModuleWidget::drawCpuMeter(NVGcontext *vg) {
+	// Bar along the bottom edge, scaled so a full-width bar is the entire block budget of one core
+	float height = 15.0;
+	float y = box.size.y - height;
+	nvgBeginPath(vg);
+	nvgRect(vg, 0, y, box.size.x, height);
+	nvgFillColor(vg, nvgRGBAf(0, 0, 0, 0.75));
+	nvgFill(vg);
+
+	float width = clamp(module->cpuTime, 0.f, 1.f) * box.size.x;
+	nvgBeginPath(vg);
+	nvgRect(vg, 0, y, width, height);
+	nvgFillColor(vg, nvgRGBAf(0.8, 0.2, 0.2, 0.75));
+	nvgFill(vg);
+
+	float peakX = clamp(module->cpuPeak, 0.f, 1.f) * box.size.x;
+	nvgBeginPath(vg);
+	nvgRect(vg, peakX - 1, y, 2, height);
+	nvgFillColor(vg, nvgRGBAf(1, 0.8, 0.2, 0.9));
+	nvgFill(vg);
+
+	std::string text = stringf("%.1f%%", module->cpuTime * 100.f);
+	bndIconLabelValue(vg, 2, y, box.size.x, height, -1, nvgRGBf(1, 1, 1), BND_LEFT, BND_LABEL_FONT_SIZE, text.c_str(), NULL);
+}
+
+void ModuleWidget::drawDenormalMeter(NVGcontext *vg) {
+	// Label along the top edge, only shown for modules which read or write denormals
+	float height = 15.0;
+	nvgBeginPath(vg);
+	nvgRect(vg, 0, 0, box.size.x, height);
+	nvgFillColor(vg, nvgRGBAf(0.6, 0, 0.6, 0.75));
+	nvgFill(vg);
+
+	std::string text = stringf("Denormals in %d out %d", module->denormalInputs, module->denormalOutputs);
+	bndIconLabelValue(vg, 2, 0, box.size.x, height, -1, nvgRGBf(1, 1, 1), BND_LEFT, BND_LABEL_FONT_SIZE, text.c_str(), NULL);
+}
+
 void ModuleWidget::drawShadow(NVGcontext *vg) {
 	nvgBeginPath(vg);
 	float r = 20; // Blur radius
@@ -503,6 +569,14 @@ struct ModuleRandomizeItem : MenuItem {
 	}
 };
 
+struct ModuleBypassItem : MenuItem {
+	ModuleWidget *moduleWidget;
+	void onAction(EventAction &e) override {
+		Module *module = moduleWidget->module;
+		engineSetModuleBypass(module, !module->bypassed);
+	}
+};
+
 struct ModuleCopyItem : MenuItem {
 	ModuleWidget *moduleWidget;
 	void onAction(EventAction &e) override {
@@ -572,6 +646,14 @@ Menu *ModuleWidget::createContextMenu() {
 	disconnectItem->moduleWidget = this;
 	menu->addChild(disconnectItem);
 
+	if (module && engineCanBypassModule(module)) {
+		ModuleBypassItem *bypassItem = new ModuleBypassItem();
+		bypassItem->text = "Bypass";
+		bypassItem->rightText = CHECKMARK(module->bypassed);
+		bypassItem->moduleWidget = this;
+		menu->addChild(bypassItem);
+	}
+
 	ModuleCloneItem *cloneItem = new ModuleCloneItem();
 	cloneItem->text = "Duplicate";
 	cloneItem->rightText = WINDOW_MOD_KEY_NAME "+D";
@@ -77,8 +77,11 @@ RackWidget::~RackWidget() {
 
 void RackWidget::clear() {
 	wireContainer->activeWire = NULL;
+	// Swap the engine to the empty patch once instead of for every wire and module
+	engineBeginTransaction();
 	wireContainer->clearChildren();
 	moduleContainer->clearChildren();
+	engineCommitTransaction();
 
 	gRackScene->scrollWidget->offset = Vec(0, 0);
 }
@@ -163,8 +166,11 @@ bool RackWidget::loadPatch(std::string path) {
 	json_t *rootJ = json_loadf(file, 0, &error);
 	fclose(file);
 	if (rootJ) {
+		// The engine switches from the old patch to the loaded one in a single step
+		engineBeginTransaction();
 		clear();
 		fromJson(rootJ);
+		engineCommitTransaction();
 		json_decref(rootJ);
 		
 		return true;
@@ -186,11 +192,13 @@ void RackWidget::revert() {
 }
 
 void RackWidget::disconnect() {
+	engineBeginTransaction();
 	for (Widget *w : moduleContainer->children) {
 		ModuleWidget *moduleWidget = dynamic_cast<ModuleWidget*>(w);
 		assert(moduleWidget);
 		moduleWidget->disconnect();
 	}
+	engineCommitTransaction();
 }
 
 json_t *RackWidget::toJson() {
@@ -3,6 +3,7 @@
 #include "engine.hpp"
 #include "settings.hpp"
 #include "asset.hpp"
+#include <thread>
 
 namespace rack {
 
@@ -119,6 +120,53 @@ struct SensitiveKnobsItem : MenuItem {
 	}
 };
 
+struct CpuMeterItem : MenuItem {
+	void onAction(EventAction &e) override {
+		gCpuMeter = !gCpuMeter;
+	}
+};
+
+struct DenormalMeterItem : MenuItem {
+	void onAction(EventAction &e) override {
+		gDenormalMeter = !gDenormalMeter;
+		// Count from scratch
+		for (Module *module : gModules) {
+			module->denormalInputs = 0;
+			module->denormalOutputs = 0;
+		}
+	}
+};
+
+struct AdaptiveQualityItem : MenuItem {
+	void onAction(EventAction &e) override {
+		gAdaptiveQuality = !gAdaptiveQuality;
+	}
+};
+
+struct ThreadCountValueItem : MenuItem {
+	int count;
+	void onAction(EventAction &e) override {
+		threadCount = count;
+		engineSetThreadCount(count);
+	}
+};
+
+struct ThreadCountItem : MenuItem {
+	Menu *createChildMenu() override {
+		Menu *menu = new Menu();
+		ThreadCountValueItem *autoItem = MenuItem::create<ThreadCountValueItem>("Automatic", CHECKMARK(threadCount == 0));
+		autoItem->count = 0;
+		menu->addChild(autoItem);
+		int maxCount = std::max((int) std::thread::hardware_concurrency(), 1);
+		for (int count = 1; count <= maxCount; count++) {
+			ThreadCountValueItem *item = MenuItem::create<ThreadCountValueItem>(stringf("%d", count), CHECKMARK(threadCount == count));
+			item->count = count;
+			menu->addChild(item);
+		}
+		return menu;
+	}
+};
+
 struct OptionsChoice : ChoiceButton {
 	void onAction(EventAction &e) override {
 		Menu *menu = gScene->createMenu();
@@ -128,6 +176,12 @@ struct OptionsChoice : ChoiceButton {
 		menu->addChild(MenuItem::create<LargerHitBoxesItem>("Larger Hit Boxes", CHECKMARK(largerHitBoxes)));
 		menu->addChild(MenuItem::create<LockModulesItem>("Lock Modules", CHECKMARK(lockModules)));
 		menu->addChild(MenuItem::create<SensitiveKnobsItem>("Sensitive Knobs", CHECKMARK(!isNear(knobSensitivity, KNOB_SENSITIVITY))));
+		menu->addChild(MenuItem::create<CpuMeterItem>("CPU Meter", CHECKMARK(gCpuMeter)));
+		menu->addChild(MenuItem::create<DenormalMeterItem>("Denormal Meter", CHECKMARK(gDenormalMeter)));
+		menu->addChild(MenuItem::create<AdaptiveQualityItem>("Adaptive Quality", CHECKMARK(gAdaptiveQuality)));
+#ifndef ARCH_WEB
+		menu->addChild(MenuItem::create<ThreadCountItem>("Engine Threads", stringf("%d", engineGetThreadCount())));
+#endif
 	}
 };
 
@@ -112,8 +112,7 @@ void WireWidget::updateWire() {
 	}
 	else {
 		if (wire) {
-			engineRemoveWire(wire);
-			delete wire;
+			engineDeleteWire(wire);
 			wire = NULL;
 		}
 	}
@@ -2,11 +2,16 @@
 #include "util/common.hpp"
 #include "bridge.hpp"
 #include "engine.hpp"
+#include <algorithm>
 
 
 namespace rack {
 
 
+static bool offline = false;
+static std::vector<AudioIO*> offlineStreams;
+
+
 AudioIO::AudioIO() {
 #ifndef ARCH_WEB
 	setDriver(RtAudio::UNSPECIFIED);
@@ -56,6 +61,11 @@ void AudioIO::setDriver(int driver) {
 	// Close device
 	setDevice(-1, 0);
 
+	if (offline) {
+		this->driver = driver;
+		return;
+	}
+
 	// Close driver
 	if (rtAudio) {
 		delete rtAudio;
@@ -216,7 +226,7 @@ void AudioIO::setSampleRate(int sampleRate) {
 std::vector<int> AudioIO::getBlockSizes() {
 #ifndef ARCH_WEB
 	if (rtAudio) {
-		return {/*64,*/ 128, 256, 512, 1024, 2048, 4096};
+		return {16, 32, 64, 128, 256, 512, 1024, 2048, 4096};
 	}
 	return {};
 #else
@@ -259,6 +269,16 @@ extern "C" void processAudioJS(int blockSize) {
 #endif
 
 void AudioIO::openStream() {
+	if (offline) {
+		// Ignore the device, the stream is driven by audioProcessOffline()
+		if (std::find(offlineStreams.begin(), offlineStreams.end(), this) == offlineStreams.end())
+			offlineStreams.push_back(this);
+		sampleRate = (int) engineGetSampleRate();
+		setChannels(2, 0);
+		onOpenStream();
+		return;
+	}
+
 	if (device < 0)
 		return;
 
@@ -363,6 +383,14 @@ void AudioIO::openStream() {
 void AudioIO::closeStream() {
 	setChannels(0, 0);
 
+	if (offline) {
+		auto it = std::find(offlineStreams.begin(), offlineStreams.end(), this);
+		if (it != offlineStreams.end())
+			offlineStreams.erase(it);
+		onCloseStream();
+		return;
+	}
+
 #ifndef ARCH_WEB
 	if (rtAudio) {
 		if (rtAudio->isStreamRunning()) {
@@ -449,4 +477,20 @@ void AudioIO::fromJson(json_t *rootJ) {
 }
 
 
+void audioSetOffline(bool enabled) {
+	offline = enabled;
+}
+
+bool audioIsOffline() {
+	return offline;
+}
+
+bool audioProcessOffline(float *output, int frames) {
+	if (offlineStreams.empty())
+		return false;
+	offlineStreams[0]->processStream(NULL, output, frames);
+	return true;
+}
+
+
 } // namespace rack
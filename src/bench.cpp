@@ -0,0 +1,325 @@
+#include "bench.hpp"
+#include "engine.hpp"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <random>
+#include <sstream>
+#include <thread>
+
+
+namespace rack {
+
+
+/** Kernel of BenchModule while BenchOptions::batch is enabled */
+static ModuleBatch benchBatch;
+
+/** Placeholder module with roughly the cost of a small filter. Sums its inputs into a soft clipped one-pole lowpass, or runs a sawtooth if nothing is patched. */
+struct BenchModule : Module {
+	float phase = 0.f;
+	float state = 0.f;
+
+	BenchModule(int numInputs) : Module(1, numInputs, 1) {
+		params[0].value = 0.5f;
+		// Nothing listens to the synthetic patches, which would otherwise be suspended
+		sideEffects = true;
+		if (benchBatch.process)
+			batch = &benchBatch;
+	}
+
+	void step() override {
+		float x = 0.f;
+		bool patched = false;
+		for (Input &input : inputs) {
+			x += input.value;
+			patched |= input.active;
+		}
+		if (!patched) {
+			phase += 110.f * engineGetSampleTime();
+			if (phase >= 1.f)
+				phase -= 1.f;
+			x = 10.f * phase - 5.f;
+		}
+		state += params[0].value * (x - state);
+		float y = 0.8f * state;
+		outputs[0].value = 5.f * y / (5.f + std::fabs(y));
+	}
+};
+
+
+typedef float BenchVector __attribute__((vector_size(16)));
+typedef int32_t BenchMask __attribute__((vector_size(16)));
+
+static BenchVector select(BenchMask mask, BenchVector a, BenchVector b) {
+	return (BenchVector) ((mask & (BenchMask) a) | (~mask & (BenchMask) b));
+}
+
+/** BenchModule::step() of up to four modules at once, one per SIMD lane. The ports are gathered and scattered per frame, the state stays in registers. */
+static void processBench(Module **modules, int count, const Module::ProcessArgs &args, int frames) {
+	const int lanes = 4;
+	BenchModule *lane[lanes] = {};
+	BenchVector phase = {}, state = {}, param = {};
+	BenchMask patched = {};
+	for (int l = 0; l < count; l++) {
+		lane[l] = static_cast<BenchModule*>(modules[l]);
+		phase[l] = lane[l]->phase;
+		state[l] = lane[l]->state;
+		param[l] = lane[l]->params[0].value;
+		for (Input &input : lane[l]->inputs) {
+			if (input.active)
+				patched[l] = -1;
+		}
+	}
+
+	for (int i = 0; i < frames; i++) {
+		BenchVector x = {};
+		for (int l = 0; l < count; l++) {
+			for (Input &input : lane[l]->inputs)
+				x[l] += input.block[i];
+		}
+		BenchVector nextPhase = phase + 110.f * args.sampleTime;
+		nextPhase = select(nextPhase >= 1.f, nextPhase - 1.f, nextPhase);
+		phase = select(patched, phase, nextPhase);
+		x = select(patched, x, 10.f * phase - 5.f);
+		state += param * (x - state);
+		BenchVector y = 0.8f * state;
+		BenchVector magnitude = (BenchVector) ((BenchMask) y & 0x7fffffff);
+		BenchVector out = 5.f * y / (5.f + magnitude);
+		for (int l = 0; l < count; l++) {
+			if (lane[l]->outputs[0].block)
+				lane[l]->outputs[0].block[i] = out[l];
+		}
+	}
+
+	for (int l = 0; l < count; l++) {
+		lane[l]->phase = phase[l];
+		lane[l]->state = state[l];
+	}
+}
+
+
+struct BenchGraph {
+	std::vector<Module*> modules;
+	std::vector<Wire*> wires;
+
+	void addModule(Module *module) {
+		engineAddModule(module);
+		modules.push_back(module);
+	}
+	void addWire(Module *outputModule, Module *inputModule, int inputId) {
+		Wire *wire = new Wire();
+		wire->outputModule = outputModule;
+		wire->outputId = 0;
+		wire->inputModule = inputModule;
+		wire->inputId = inputId;
+		engineAddWire(wire);
+		wires.push_back(wire);
+	}
+	void clear() {
+		engineBeginTransaction();
+		for (Wire *wire : wires)
+			engineDeleteWire(wire);
+		wires.clear();
+		for (Module *module : modules)
+			engineDeleteModule(module);
+		modules.clear();
+		engineCommitTransaction();
+	}
+};
+
+
+/** One source driving every other module */
+static void buildFanout(BenchGraph *graph, int n) {
+	Module *source = new BenchModule(0);
+	graph->addModule(source);
+	for (int i = 1; i < n; i++) {
+		Module *module = new BenchModule(1);
+		graph->addModule(module);
+		graph->addWire(source, module, 0);
+	}
+}
+
+/** Every module in series, which leaves nothing to parallelize */
+static void buildChain(BenchGraph *graph, int n) {
+	Module *last = NULL;
+	for (int i = 0; i < n; i++) {
+		Module *module = new BenchModule(1);
+		graph->addModule(module);
+		if (last)
+			graph->addWire(last, module, 0);
+		last = module;
+	}
+}
+
+/** Each module reads two random earlier modules, with a fixed seed so runs are comparable */
+static void buildDag(BenchGraph *graph, int n) {
+	std::mt19937 rng(1);
+	for (int i = 0; i < n; i++) {
+		Module *module = new BenchModule(2);
+		graph->addModule(module);
+		if (i == 0)
+			continue;
+		for (int j = 0; j < 2; j++) {
+			int source = std::uniform_int_distribution<int>(std::max(i - 16, 0), i - 1)(rng);
+			graph->addWire(graph->modules[source], module, j);
+		}
+	}
+}
+
+/** Independent feedback loops of 8 modules, which are stepped sample by sample */
+static void buildRing(BenchGraph *graph, int n) {
+	const int ringSize = 8;
+	for (int i = 0; i < n; i += ringSize) {
+		int size = std::min(ringSize, n - i);
+		Module *first = NULL;
+		Module *last = NULL;
+		for (int j = 0; j < size; j++) {
+			Module *module = new BenchModule(1);
+			graph->addModule(module);
+			if (last)
+				graph->addWire(last, module, 0);
+			else
+				first = module;
+			last = module;
+		}
+		graph->addWire(last, first, 0);
+	}
+}
+
+
+struct BenchResult {
+	double framesPerSecond;
+	/** Block latency percentiles in microseconds */
+	double p50, p90, p99, max;
+	/** Average delay in microseconds until the last worker woke up for a block, see engineGetBarrierStats() */
+	double wake;
+	/** CPU time of all threads per second of audio */
+	double cpu;
+	/** Blocks which took longer than their duration */
+	int overruns;
+};
+
+typedef std::chrono::steady_clock BenchClock;
+
+static BenchResult measure(bool multithreaded, int blockSize, float sampleRate, float seconds, bool paced) {
+	auto blockStep = [&]() {
+		if (multithreaded) {
+			engineStepMT(blockSize);
+			engineWaitMT();
+		}
+		else {
+			for (int i = 0; i < blockSize; i++)
+				engineStep();
+		}
+	};
+
+	// Warm up caches and let the schedule be rebuilt
+	for (int i = 0; i < 16; i++)
+		blockStep();
+
+	double budget = 1e6 * blockSize / sampleRate;
+	std::vector<double> latencies;
+	std::clock_t cpuStart = std::clock();
+	auto start = BenchClock::now();
+	auto end = start + std::chrono::duration<double>(seconds);
+	auto now = start;
+	while (now < end) {
+		if (paced) {
+			// Stay on the device clock even after an overrun, like a callback catching up
+			std::this_thread::sleep_until(start + std::chrono::duration<double, std::micro>(latencies.size() * budget));
+			now = BenchClock::now();
+		}
+		auto blockStart = now;
+		blockStep();
+		now = BenchClock::now();
+		latencies.push_back(std::chrono::duration<double, std::micro>(now - blockStart).count());
+	}
+	double duration = std::chrono::duration<double>(now - start).count();
+	double cpuDuration = (double) (std::clock() - cpuStart) / CLOCKS_PER_SEC;
+	int overruns = std::count_if(latencies.begin(), latencies.end(), [&](double latency) {
+		return latency > budget;
+	});
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&](double p) {
+		return latencies[std::min((size_t) (p * latencies.size()), latencies.size() - 1)];
+	};
+	BenchResult result;
+	result.framesPerSecond = latencies.size() * blockSize / duration;
+	result.p50 = percentile(0.50);
+	result.p90 = percentile(0.90);
+	result.p99 = percentile(0.99);
+	result.max = latencies.back();
+	result.wake = multithreaded ? 1e6 * engineGetBarrierStats().wakeLatency : 0.0;
+	result.cpu = cpuDuration / (latencies.size() * blockSize / sampleRate);
+	result.overruns = overruns;
+	return result;
+}
+
+static void printResult(const char *graph, const char *path, int threads, int blockSize, float sampleRate, const BenchResult &result, double baseline) {
+	double budget = 1e6 * blockSize / sampleRate;
+	printf("%-7s %-4s %7d %6d %12.0f %8.1fx %8.2fx %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %8.1f%% %9d\n",
+		graph, path, threads, blockSize,
+		result.framesPerSecond, result.framesPerSecond / sampleRate, result.framesPerSecond / baseline,
+		result.p50, result.p90, result.p99, result.max, result.wake, budget, 100.0 * result.cpu, result.overruns);
+	fflush(stdout);
+}
+
+void benchRun(const BenchOptions &options) {
+	engineSetSampleRate(options.sampleRate);
+	benchBatch.process = options.batch ? processBench : NULL;
+
+	std::vector<int> threadCounts = options.threadCounts;
+	if (threadCounts.empty()) {
+		int hardwareThreads = std::max((int) std::thread::hardware_concurrency(), 1);
+		for (int count = 1; count < hardwareThreads; count *= 2)
+			threadCounts.push_back(count);
+		threadCounts.push_back(hardwareThreads);
+	}
+
+	printf("%d modules per graph, %g s per measurement, sample rate %g Hz, %s\n", options.modules, options.seconds, options.sampleRate,
+		options.paced ? "blocks paced like an audio device" : "blocks back to back");
+	if (options.batch)
+		printf("Modules on the same level are processed four at a time by a SIMD kernel\n");
+	printf("Scaling is relative to engineStep() at the same block size, latencies and the block budget are in us\n");
+	printf("CPU is the time used by all threads per second of audio, overruns are blocks which took longer than the budget\n");
+	printf("%-7s %-4s %7s %6s %12s %9s %9s %9s %9s %9s %9s %9s %9s %9s %9s\n",
+		"graph", "path", "threads", "block", "frames/s", "realtime", "scaling", "p50", "p90", "p99", "max", "wake", "budget", "cpu", "overruns");
+
+	std::stringstream graphs(options.graphs);
+	std::string name;
+	while (std::getline(graphs, name, ',')) {
+		BenchGraph graph;
+		engineBeginTransaction();
+		if (name == "fanout")
+			buildFanout(&graph, options.modules);
+		else if (name == "chain")
+			buildChain(&graph, options.modules);
+		else if (name == "dag")
+			buildDag(&graph, options.modules);
+		else if (name == "ring")
+			buildRing(&graph, options.modules);
+		else
+			warn("Unknown benchmark graph %s", name.c_str());
+		engineCommitTransaction();
+		if (graph.modules.empty())
+			continue;
+
+		for (int blockSize : options.blockSizes) {
+			BenchResult single = measure(false, blockSize, options.sampleRate, options.seconds, options.paced);
+			printResult(name.c_str(), "st", 1, blockSize, options.sampleRate, single, single.framesPerSecond);
+			for (int threads : threadCounts) {
+				engineSetThreadCount(threads);
+				BenchResult result = measure(true, blockSize, options.sampleRate, options.seconds, options.paced);
+				printResult(name.c_str(), "mt", threads, blockSize, options.sampleRate, result, single.framesPerSecond);
+			}
+		}
+		graph.clear();
+	}
+
+	// Back to one worker per hardware thread
+	engineSetThreadCount(0);
+}
+
+
+} // namespace rack
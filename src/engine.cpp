@@ -1,14 +1,24 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
 #include <vector>
 #include <algorithm>
 #include <chrono>
 #include <thread>
+#include <atomic>
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <errno.h>
+#if ARCH_LIN || ARCH_MAC
+#include <sys/mman.h>
+#endif
 #if !(defined(__arm__) || defined(__aarch64__) || defined(ARCH_WEB))
 #include <pmmintrin.h>
 #include <xmmintrin.h>
+#include <x86intrin.h>
 #endif
 #include "tinythread.h"
 #include "concurrentqueue.h"
@@ -18,6 +28,9 @@
 namespace rack {
 
 bool gPaused = false;
+bool gCpuMeter = false;
+bool gDenormalMeter = false;
+bool gAdaptiveQuality = true;
 std::vector<Module*> gModules;
 std::vector<Wire*> gWires;
 
@@ -27,24 +40,217 @@ static float sampleTime;
 
 // static std::thread thread;
 
-// Parameter interpolation
-static Module *smoothModule = NULL;
-static int smoothParamId;
-static float smoothValue;
+/** A param change sent with engineSetParam() or engineSetParamSmooth() */
+struct ParamEvent {
+    Module *module;
+    int paramId;
+    float value;
+    /** Frame of the block at which the value is set, counted from the block which drains the event */
+    int frame;
+    /** Duration in seconds over which the param moves towards the value, see engineSetParamSmooth(). 0 sets it at once. */
+    float rampTime;
+};
 
-struct UOW {
+/** A param moving linearly towards its target */
+struct ParamRamp {
     Module *module;
-    int step, step2;
+    int paramId;
+    float value;
+    float target;
+    /** Change of the value per frame */
+    float delta;
+    int framesLeft;
+};
+
+/** A unit of scheduling, the modules of which are stepped sample-by-sample in order by a single worker.
+Modules which are not part of a cycle get a task of their own.
+*/
+struct Task {
+    std::vector<Module*> modules;
+    /** Indices of the tasks which read from this task */
+    std::vector<int> successors;
+    /** Number of distinct tasks which must finish the block before this one can start */
+    int numDeps = 0;
+    /** Topological level, 0 for tasks with no dependencies */
+    int level = 0;
+    /** Whether the modules read from each other within the block */
+    bool cyclic = false;
+    /** Whether the modules share a ModuleBatch and are processed together by its kernel */
+    bool batched = false;
+    /** Whether any module has quality levels, so its CPU time is measured for gAdaptiveQuality */
+    bool quality = false;
+    /** CPU meter scratch space for cyclic tasks, one entry per module */
+    std::vector<uint64_t> ticks;
+    /** Param changes due within the running block, sorted by frame */
+    std::vector<ParamEvent> events;
+    /** One per input of the modules of an acyclic task, the output feeding it if the module reads Input::constant, otherwise NULL */
+    std::vector<const Output*> inputSources;
+    /** Outputs of the modules which feed an input in inputSources, checked for constant blocks once the task is done */
+    std::vector<Output*> checkedOutputs;
+};
+
+/** A wire as the engine sees it, with bypassed modules routed through */
+struct Link {
+    /** NULL if the signal ends at a bypassed module */
+    Module *outputModule;
+    int outputId;
+    Module *inputModule;
+    int inputId;
+};
+
+/** The flattened patch stepped by the engine.
+Compiled from gModules and gWires when a transaction is committed, without blocking the audio thread, and swapped in between two blocks.
+*/
+struct Graph {
+    std::vector<Module*> modules;
+    std::vector<Wire*> wires;
+    /** One per wire, from the output which feeds it through any bypassed modules */
+    std::vector<Link> links;
+    std::vector<Task> tasks;
+    std::vector<int> rootTasks;
+    /** Index of the task stepping each module */
+    std::unordered_map<Module*, int> moduleTasks;
+    std::unique_ptr<std::atomic<int>[]> taskPending;
+
+    // Port buffers, see layoutPorts()
+    std::vector<float> pool;
+    /** Read by unconnected inputs */
+    std::vector<float> silence;
+    /** Number of samples after the carried sample which the port buffers can hold */
+    int steps = 0;
+    /** Output::queue of every output of `modules` in order, NULL if not connected */
+    std::vector<float*> outputQueues;
+    /** Connected outputs of the stepped modules, whose last sample is carried to the next block */
+    std::vector<float*> carriedQueues;
+    /** Input::block of every input of `modules` in order */
+    std::vector<const float*> inputBlocks;
+
+    /** Modules of the previous graph which are not part of this one */
+    std::vector<Module*> removedModules;
+    /** Modules which are not stepped since none of their outputs lead to a sink */
+    std::vector<Module*> suspendedModules;
+};
+
+/** Only replaced while no block is running */
+static std::atomic<Graph*> graph(new Graph());
+static std::atomic<int> tasksLeft;
+/** Number of tasks pushed to a deque and not taken yet, so idle workers know whether there is anything to steal */
+static std::atomic<int> readyTasks(0);
+/** Whether the port blocks point to the port values for engineStep() */
+static bool portsOnValues = false;
+
+// Transactions, only used by the thread which edits the patch
+static int transactionDepth = 0;
+/** Whether gModules or gWires changed since the graph was compiled */
+static bool graphDirty = false;
+/** Wire plugged into each input of gWires, for constant time checks */
+static std::unordered_map<const Input*, Wire*> inputWires;
+/** Removed by engineDeleteModule() and engineDeleteWire() during the transaction, deleted once it is committed */
+static std::vector<Module*> deletedModules;
+static std::vector<Wire*> deletedWires;
+/** Removed during the transaction and still in gModules and gWires, which are filtered in a single pass when it is committed.
+Keeps removing a large selection linear in the size of the patch.
+*/
+static std::unordered_set<Module*> removingModules;
+static std::unordered_set<Wire*> removingWires;
+/** Param changes from any thread, drained at the start of each block */
+static moodycamel::ConcurrentQueue<ParamEvent> paramQueue;
+/** Number of engineNotifyLive() calls */
+static std::atomic<unsigned> liveCount(0);
+/** Drained param changes which are due in a later block. Only touched with no block running. */
+static std::vector<ParamEvent> pendingParams;
+/** Active ramps, removed once they reach their target. Only touched with no block running. */
+static std::vector<ParamRamp> paramRamps;
+/** Number of frames between two values of a ramp */
+static const int rampFrames = 16;
+
+/** Block size of the last engineStepMT() call, so new graphs are compiled for the current block size.
+A graph's buffers only grow with larger blocks until the next graph replaces it, so one long block doesn't inflate them for good.
+*/
+static std::atomic<int> lastSteps(0);
+
+/** Tasks whose dependencies have finished, owned by one worker.
+The owner pushes and pops at the back so consumers tend to run on the core which produced their input, idle workers steal from the front.
+*/
+struct WorkDeque {
+    std::vector<int> ring;
+    size_t head = 0;
+    size_t tail = 0;
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+
+    void lock() {
+        while (busy.test_and_set(std::memory_order_acquire))
+            std::this_thread::yield();
+    }
+    void unlock() {
+        busy.clear(std::memory_order_release);
+    }
+    /** Must be called while no block is running. Each task is pushed at most once per block, so the number of tasks is enough. */
+    void reset(size_t capacity) {
+        ring.resize(std::max(capacity, (size_t) 1));
+        head = tail = 0;
+    }
+    void push(int t) {
+        lock();
+        ring[tail++ % ring.size()] = t;
+        unlock();
+    }
+    bool pop(int *t) {
+        lock();
+        bool ok = (tail != head);
+        if (ok)
+            *t = ring[--tail % ring.size()];
+        unlock();
+        return ok;
+    }
+    bool steal(int *t) {
+        lock();
+        bool ok = (tail != head);
+        if (ok)
+            *t = ring[head++ % ring.size()];
+        unlock();
+        return ok;
+    }
 };
-moodycamel::ConcurrentQueue<UOW> q;
-moodycamel::ProducerToken *ptoks[10];
-moodycamel::ConsumerToken *ctoks[10];
-volatile int runningt;
 
+struct Worker {
+    int id;
+    WorkDeque deque;
+    tthread::thread *thread = NULL;
+    std::atomic<bool> quit;
+    /** Last block started by this worker */
+    unsigned blockId;
+    /** When the worker woke up for and finished its last block, for the barrier stats */
+    uint64_t wakeTicks = 0;
+    uint64_t doneTicks = 0;
+
+    Worker() : quit(false) {}
+};
+
+static std::vector<Worker*> workers;
+/** Requested number of workers, 0 to leave one hardware thread to the audio thread and use the others */
+static int threadCountSetting = 0;
+static EngineThreadConfig threadConfig;
+
+/** Number of workers which haven't finished the running block */
+static std::atomic<int> runningt(0);
+/** Incremented for every block, so workers can tell a new block from a spurious wakeup */
+static std::atomic<unsigned> blockId(0);
+
+/** Held to start a block or to change the graph or the pool in between two blocks */
 tthread::mutex m;
-tthread::condition_variable cond;
-tthread::condition_variable cond2;
 int numWorkers;
+static int runningSteps;
+/** When the running block was handed to the workers */
+static uint64_t blockStartTicks = 0;
+/** Block last accounted in barrierStats and loadStats */
+static unsigned statsBlockId = 0;
+static EngineBarrierStats barrierStats;
+static EngineLoadStats loadStats;
+/** Modules whose quality was lowered by the load monitor, most recent last, so they are restored in reverse order */
+static std::vector<Module*> degradedModules;
+/** Seconds since the load monitor last changed a quality level */
+static float qualityHoldTime = 0.f;
 
 float Light::getBrightness() {
     // LEDs are diodes, so don't allow reverse current.
@@ -69,214 +275,1461 @@ void Light::setBrightnessSmooth(float brightness, float frames) {
 }
 
 
+void Module::process(const ProcessArgs &args, int frames) {
+    for (int i = 0; i < frames; i++) {
+        for (Input &in : inputs)
+            in.value = in.block[i];
+
+        step();
+
+        for (Output &out : outputs) {
+            if (out.block)
+                out.block[i] = out.value;
+        }
+    }
+}
+
+
 void Wire::step() {
     float value = outputModule->outputs[outputId].value;
     inputModule->inputs[inputId].value = value;
 }
 
-void Wire::stepMultiple(int steps) {
-    for (int i = 0; i < steps; i++) {
-        float value = outputModule->outputs[outputId].queue[i];
-        inputModule->inputs[inputId].queue[i] = value;
+// CPU meter
+
+/** Tick frequency of readTicks(), measured in engineInit() */
+static double ticksPerSecond = 1e9;
+
+/** Reads a cheap monotonic counter. Only differences are meaningful. */
+static inline uint64_t readTicks() {
+#if !(defined(__arm__) || defined(__aarch64__) || defined(ARCH_WEB))
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t ticks;
+    asm volatile("mrs %0, cntvct_el0" : "=r" (ticks));
+    return ticks;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static void calibrateTicks() {
+#if !(defined(__arm__) || defined(__aarch64__) || defined(ARCH_WEB))
+    auto startTime = std::chrono::steady_clock::now();
+    uint64_t startTicks = readTicks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    uint64_t endTicks = readTicks();
+    double duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    ticksPerSecond = (endTicks - startTicks) / duration;
+#elif defined(__aarch64__)
+    uint64_t freq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (freq));
+    ticksPerSecond = freq;
+#endif
+}
+
+static inline void cpuRelax() {
+#if !(defined(__arm__) || defined(__aarch64__) || defined(ARCH_WEB))
+    _mm_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+/** Lets threads wait for a state published through atomics, spinning for a while before sleeping.
+The waker changes the state before calling wake(), which only takes the mutex if someone is asleep.
+*/
+struct SpinParker {
+    tthread::mutex mutex;
+    tthread::condition_variable cond;
+    std::atomic<int> sleepers;
+    /** Counts of all waits and of the ones which slept, for the barrier stats */
+    std::atomic<unsigned> waits;
+    std::atomic<unsigned> parks;
+
+    SpinParker() : sleepers(0), waits(0), parks(0) {}
+
+    template <typename Ready>
+    void wait(Ready ready, uint64_t spinTicks) {
+        waits.fetch_add(1, std::memory_order_relaxed);
+        if (ready())
+            return;
+        uint64_t startTicks = readTicks();
+        while (readTicks() - startTicks < spinTicks) {
+            cpuRelax();
+            if (ready())
+                return;
+        }
+
+        parks.fetch_add(1, std::memory_order_relaxed);
+        mutex.lock();
+        sleepers.fetch_add(1);
+        // Pairs with the fence in wake(), so either the waker sees the sleeper or the sleeper sees the new state
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        while (!ready())
+            cond.wait(mutex);
+        sleepers.fetch_sub(1);
+        mutex.unlock();
     }
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers.load(std::memory_order_relaxed) > 0) {
+            // Taking the mutex makes sure the sleeper is either before its last check or waiting
+            mutex.lock();
+            mutex.unlock();
+            cond.notify_all();
+        }
+    }
+};
+
+/** Workers wait here for the next block */
+static SpinParker blockParker;
+/** engineWaitMT() and the patch and pool edits wait here for the workers to finish the block */
+static SpinParker doneParker;
+/** Workers with nothing to steal wait here for a task to become ready or for the block to end */
+static SpinParker taskParker;
+/** EngineThreadConfig::spinTime in ticks */
+static std::atomic<uint64_t> spinTicks(0);
+
+/** Accumulates the time a module spent on a block into its meter, as a fraction of the block's duration */
+static void updateCpuTime(Module *module, uint64_t ticks, int steps) {
+    float blockTime = steps * sampleTime;
+    float load = (float) (ticks / ticksPerSecond) / blockTime;
+    // Average over roughly half a second and let the peak fall over a few seconds
+    float lambda = std::min(blockTime / 0.5f, 1.f);
+    module->cpuTime += (load - module->cpuTime) * lambda;
+    module->cpuPeak = std::max(load, module->cpuPeak * (1.f - std::min(blockTime / 3.f, 1.f)));
 }
 
-void do_work(int qq)
-{
+/** Returns whether every sample of the block is the same. Stops at the first change, so varying signals are cheap to check. */
+static bool isConstant(const float *block, int frames) {
+    float first = block[0];
+    for (int i = 1; i < frames; i++) {
+        if (block[i] != first)
+            return false;
+    }
+    return true;
+}
+
+/** Sets Input::constant of an acyclic task's modules from the outputs feeding them, which were checked when their tasks finished */
+static void setInputsConstant(Task &task) {
+    size_t i = 0;
+    for (Module *module : task.modules) {
+        for (auto &in : module->inputs) {
+            const Output *source = task.inputSources[i++];
+            in.constant = !in.active || (source && source->constant);
+        }
+    }
+}
+
+/** Checks the outputs of the task read by modules which use Input::constant.
+Each output is checked once by its producer, however many inputs it fans out to. Inputs read the block delayed by the carried sample in queue[0].
+*/
+static void checkOutputsConstant(Task &task, int steps) {
+    for (Output *out : task.checkedOutputs)
+        out->constant = isConstant(out->queue, steps);
+}
+
+/** Moves the port blocks of the module by `frames` */
+static void shiftBlocks(Module *module, int frames) {
+    for (auto &in : module->inputs)
+        in.block += frames;
+    for (auto &out : module->outputs) {
+        if (out.block)
+            out.block += frames;
+    }
+}
+
+/** Processes `frames` frames of the module's block starting at `frame`.
+If `repeat`, only the first frame is processed and the outputs hold its value for the others.
+*/
+static void processFrames(Module *module, const Module::ProcessArgs &args, int frame, int frames, bool repeat) {
+    if (frame > 0)
+        shiftBlocks(module, frame);
+    if (repeat && frames > 1) {
+        module->process(args, 1);
+        for (auto &out : module->outputs) {
+            if (out.block)
+                std::fill(out.block + 1, out.block + frames, out.block[0]);
+        }
+    }
+    else {
+        module->process(args, frames);
+    }
+    if (frame > 0)
+        shiftBlocks(module, -frame);
+}
+
+/** Processes `frames` frames of the blocks of a batched task starting at `frame`, with the kernel of its modules */
+static void processBatchFrames(Task &task, const Module::ProcessArgs &args, int frame, int frames) {
+    if (frame > 0) {
+        for (Module *module : task.modules)
+            shiftBlocks(module, frame);
+    }
+    task.modules[0]->batch->process(task.modules.data(), task.modules.size(), args, frames);
+    if (frame > 0) {
+        for (Module *module : task.modules)
+            shiftBlocks(module, -frame);
+    }
+}
+
+/** Sets the FP environment of the calling thread to flush denormals to zero, and returns whether it took effect.
+Denormals show up in decaying filter and reverb tails and are 10-100x slower to compute.
+*/
+static bool setFlushToZero() {
+#if defined(ARCH_WEB)
+    return true;
+#elif defined(__aarch64__)
+    // FZ bit of FPCR, which flushes both the operands and the results
+    uint64_t fpcr;
+    __asm__ __volatile__("mrs %0, fpcr" : "=r" (fpcr));
+    fpcr |= (uint64_t) 1 << 24;
+    __asm__ __volatile__("msr fpcr, %0" : : "r" (fpcr));
+    __asm__ __volatile__("mrs %0, fpcr" : "=r" (fpcr));
+    return fpcr & ((uint64_t) 1 << 24);
+#elif defined(__arm__)
+    uint32_t fpscr;
+    __asm__ __volatile__("vmrs %0, fpscr" : "=r" (fpscr));
+    fpscr |= (uint32_t) 1 << 24;
+    __asm__ __volatile__("vmsr fpscr, %0" : : "r" (fpscr));
+    __asm__ __volatile__("vmrs %0, fpscr" : "=r" (fpscr));
+    return fpscr & ((uint32_t) 1 << 24);
+#else
+    // Set CPU to flush-to-zero (FTZ) and denormals-are-zero (DAZ) mode
+    // https://software.intel.com/en-us/node/682949
+    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
+    return _MM_GET_FLUSH_ZERO_MODE() == _MM_FLUSH_ZERO_ON && _MM_GET_DENORMALS_ZERO_MODE() == _MM_DENORMALS_ZERO_ON;
+#endif
+}
+
+/** The FP environment is per thread, so every thread which steps modules sets it the first time it does */
+static thread_local bool threadFlushToZero = false;
+
+static void initThreadFlushToZero(const char *threadName) {
+    if (threadFlushToZero)
+        return;
+    threadFlushToZero = true;
+    if (!setFlushToZero())
+        warn("Could not set flush-to-zero mode on the %s thread, denormals will be slow", threadName);
+}
+
+/** Number of blocks between two denormal checks while gDenormalMeter is enabled */
+static const unsigned denormalInterval = 16;
+
+static int countDenormals(const float *block, int frames) {
+    int count = 0;
+    for (int i = 0; i < frames; i++) {
+        uint32_t bits;
+        memcpy(&bits, &block[i], sizeof(bits));
+        // Zero exponent and nonzero mantissa
+        count += ((bits & 0x7f800000) == 0 && (bits & 0x007fffff) != 0);
+    }
+    return count;
+}
+
+static void checkDenormals(Module *module, int steps) {
+    for (auto &in : module->inputs) {
+        if (in.active)
+            module->denormalInputs += countDenormals(in.block, steps);
+    }
+    for (auto &out : module->outputs) {
+        if (out.block)
+            module->denormalOutputs += countDenormals(out.block, steps);
+    }
+}
+
+static void runTask(Task &task, int steps) {
+    bool meter = gCpuMeter || (gAdaptiveQuality && task.quality);
+    // Blocks are only sampled, since the check costs about as much as a simple module
+    bool denormals = gDenormalMeter && blockId % denormalInterval == 0;
+    Module::ProcessArgs args;
+    args.sampleRate = sampleRate;
+    args.sampleTime = sampleTime;
+
+    if (task.batched) {
+        // Like a single module below, except that the outputs are never held since the modules would have to agree
+        uint64_t startTicks = meter ? readTicks() : 0;
+        setInputsConstant(task);
+        int frame = 0;
+        for (const ParamEvent &event : task.events) {
+            if (event.frame > frame) {
+                processBatchFrames(task, args, frame, event.frame - frame);
+                frame = event.frame;
+            }
+            event.module->params[event.paramId].value = event.value;
+        }
+        if (frame < steps)
+            processBatchFrames(task, args, frame, steps - frame);
+        task.events.clear();
+        checkOutputsConstant(task, steps);
+        if (meter) {
+            // The kernel's time can't be told apart, so it is shared evenly
+            uint64_t ticks = (readTicks() - startTicks) / task.modules.size();
+            for (Module *module : task.modules)
+                updateCpuTime(module, ticks, steps);
+        }
+        if (denormals) {
+            for (Module *module : task.modules)
+                checkDenormals(module, steps);
+        }
+        return;
+    }
+
+    if (!task.cyclic) {
+        // Run the whole block. The consumers read it from the output queues once the task is finished.
+        // The block is split at the frames where params change.
+        Module *module = task.modules[0];
+        uint64_t startTicks = meter ? readTicks() : 0;
+        // The producers are finished, so the whole block of every input is known
+        setInputsConstant(task);
+        bool inputsConstant = true;
+        for (auto &in : module->inputs)
+            inputsConstant &= in.constant;
+        // A pure module with constant inputs and params has constant outputs
+        bool repeat = module->pure && inputsConstant;
+        int frame = 0;
+        for (const ParamEvent &event : task.events) {
+            if (event.frame > frame) {
+                processFrames(module, args, frame, event.frame - frame, repeat);
+                frame = event.frame;
+            }
+            module->params[event.paramId].value = event.value;
+        }
+        if (frame < steps)
+            processFrames(module, args, frame, steps - frame, repeat);
+        task.events.clear();
+        checkOutputsConstant(task, steps);
+        if (meter)
+            updateCpuTime(module, readTicks() - startTicks, steps);
+        if (denormals)
+            checkDenormals(module, steps);
+        return;
+    }
+
+    // Modules of a cycle read each other's previous sample, so they are interleaved sample-by-sample, with their blocks advanced by one frame at a time.
+    // No barrier is needed since the whole task runs on one worker and the consumers in other tasks only start once it is finished.
+    if (meter)
+        task.ticks.assign(task.modules.size(), 0);
+    // Samples from within the cycle are not known in advance
+    for (Module *module : task.modules) {
+        for (auto &in : module->inputs)
+            in.constant = !in.active;
+    }
+    size_t nextEvent = 0;
+    for (int step = 0; step < steps; step++) {
+        for (; nextEvent < task.events.size() && task.events[nextEvent].frame <= step; nextEvent++) {
+            const ParamEvent &event = task.events[nextEvent];
+            event.module->params[event.paramId].value = event.value;
+        }
+        for (size_t i = 0; i < task.modules.size(); i++) {
+            Module *module = task.modules[i];
+            uint64_t startTicks = meter ? readTicks() : 0;
+            module->process(args, 1);
+
+            for (auto &in : module->inputs)
+                in.block++;
+            for (auto &out : module->outputs) {
+                if (out.block)
+                    out.block++;
+            }
+            if (meter)
+                task.ticks[i] += readTicks() - startTicks;
+        }
+    }
+    task.events.clear();
+    checkOutputsConstant(task, steps);
+    for (Module *module : task.modules) {
+        for (auto &in : module->inputs)
+            in.block -= steps;
+        for (auto &out : module->outputs) {
+            if (out.block)
+                out.block -= steps;
+        }
+    }
+    if (meter) {
+        for (size_t i = 0; i < task.modules.size(); i++)
+            updateCpuTime(task.modules[i], task.ticks[i], steps);
+    }
+    if (denormals) {
+        for (Module *module : task.modules)
+            checkDenormals(module, steps);
+    }
+}
+
+static void finishTask(Worker *worker, Graph *g, int t) {
+    // One release per downstream task publishes the whole block, the worker which takes the last dependency acquires it
+    int pushed = 0;
+    for (int s : g->tasks[t].successors) {
+        if (g->taskPending[s].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            readyTasks.fetch_add(1, std::memory_order_relaxed);
+            worker->deque.push(s);
+            pushed++;
+        }
+    }
+    // The worker runs one of the tasks itself, so only wake the others if there are more or if the block is done
+    if (tasksLeft.fetch_sub(1, std::memory_order_acq_rel) == 1 || pushed > 1)
+        taskParker.wake();
+}
+
+static bool findTask(Worker *worker, int *t) {
+    bool found = worker->deque.pop(t);
+    int n = workers.size();
+    for (int i = 1; i < n && !found; i++)
+        found = workers[(worker->id + i) % n]->deque.steal(t);
+    if (found)
+        readyTasks.fetch_sub(1, std::memory_order_relaxed);
+    return found;
+}
+
+/** Touches the stack pages a deep process() call could reach, so they don't fault in the middle of a block */
+static void prefaultStack() {
+    volatile char stack[128 * 1024];
+    for (size_t i = 0; i < sizeof(stack); i += 4096)
+        stack[i] = 0;
+}
+
+/** Sets the scheduling policy, priority and CPU affinity of the calling worker thread from threadConfig */
+static void applyThreadConfig(Worker *worker) {
+    const EngineThreadConfig &config = threadConfig;
     pthread_t tID = pthread_self();
-    sched_param prio = { 15 };
-    if (!pthread_setschedparam(tID, SCHED_RR, &prio))
-        info("Set higher priority for audio thread.");
-    else
-        info("NOT set higher priority for audio thread.");
+    if (config.policy != EngineThreadConfig::POLICY_OTHER) {
+        int policy = (config.policy == EngineThreadConfig::POLICY_FIFO) ? SCHED_FIFO : SCHED_RR;
+        sched_param prio = {};
+        prio.sched_priority = config.priority;
+        if (!pthread_setschedparam(tID, policy, &prio))
+            info("Set priority %d for DSP thread %d.", config.priority, worker->id);
+        else
+            info("NOT set priority %d for DSP thread %d.", config.priority, worker->id);
+    }
+
+    if (!config.cpuMasks.empty()) {
+        uint64_t mask = config.cpuMasks[worker->id % config.cpuMasks.size()];
+#if ARCH_LIN
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu = 0; cpu < 64; cpu++) {
+            if (mask & ((uint64_t) 1 << cpu))
+                CPU_SET(cpu, &cpus);
+        }
+        if (!pthread_setaffinity_np(tID, sizeof(cpus), &cpus))
+            info("Pinned DSP thread %d to CPU mask 0x%llx.", worker->id, (unsigned long long) mask);
+        else
+            warn("Could not pin DSP thread %d to CPU mask 0x%llx", worker->id, (unsigned long long) mask);
+#else
+        warn("Could not pin DSP thread %d to CPU mask 0x%llx, CPU affinity is only supported on Linux", worker->id, (unsigned long long) mask);
+#endif
+    }
+
+    if (config.prefault)
+        prefaultStack();
+}
+
+/** Locks the memory mapped so far into RAM, which also faults it in. Called again after patch edits for the memory of new modules. */
+static void lockMemory() {
+    static bool failed = false;
+    if (failed)
+        return;
+#if ARCH_LIN || ARCH_MAC
+    // Not MCL_FUTURE, which would make allocations fail once the memlock limit is reached
+    if (mlockall(MCL_CURRENT)) {
+        warn("Could not lock memory: %s", strerror(errno));
+        failed = true;
+    }
+#else
+    warn("Could not lock memory, only supported on Linux and Mac");
+    failed = true;
+#endif
+}
+
+static void do_work(Worker *worker)
+{
+    initThreadFlushToZero("DSP");
+    applyThreadConfig(worker);
 
-    m.lock();
     while(1)
     {
-        do
-            cond.wait(m);
-        while (runningt <= 0);
-        m.unlock();
-
-        UOW item;
-        //while(q.try_dequeue(*ctoks[qq], item))
-        while(q.try_dequeue(item))
+        blockParker.wait([&]() {
+            return blockId.load(std::memory_order_acquire) != worker->blockId || worker->quit.load(std::memory_order_acquire);
+        }, spinTicks.load(std::memory_order_relaxed));
+        if (worker->quit.load(std::memory_order_acquire))
+            break;
+        worker->wakeTicks = readTicks();
+        // The block is published by the increment of blockId
+        worker->blockId = blockId.load(std::memory_order_acquire);
+        int steps = runningSteps;
+        Graph *g = graph.load(std::memory_order_relaxed);
+
+        // Only tasks whose producers have all finished are ever pushed, so a task always runs to completion.
+        while (tasksLeft.load(std::memory_order_acquire) > 0)
         {
-            Module *module = item.module;
-            for (int step = item.step; step < item.step2; step++)
-            {
-                for (auto &in : module->inputs)
-                {
-                    if (in.pos < step)
-                    {
-                        item.step = step;
-                        q.enqueue(*ptoks[qq], item);
-                        goto nope;
-                    }
-                    in.value = *(volatile float*)(in.queue + step);
+            int t;
+            if (!findTask(worker, &t)) {
+                // Serial stretches of the patch leave the other workers nothing to do, so park them instead of spinning for the whole block
+                taskParker.wait([]() {
+                    return readyTasks.load(std::memory_order_acquire) > 0 || tasksLeft.load(std::memory_order_acquire) == 0;
+                }, spinTicks.load(std::memory_order_relaxed));
+                continue;
+            }
+            runTask(g->tasks[t], steps);
+            finishTask(worker, g, t);
+        }
+
+        worker->doneTicks = readTicks();
+        if (runningt.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            doneParker.wake();
+    }
+}
+
+/** Waits until the workers have finished the running block. No block can start meanwhile if `m` is locked. */
+static void waitBlock() {
+    doneParker.wait([]() {
+        return runningt.load(std::memory_order_acquire) == 0;
+    }, spinTicks.load(std::memory_order_relaxed));
+}
+
+/** Gives every connected output a buffer for `steps` samples plus the carried sample, laid out contiguously in schedule order so a task's ports share cache lines.
+Connected inputs read the buffer of their output in place, so fan-out costs nothing. Unconnected inputs read silence and unconnected outputs get no buffer at all.
+Only fills in the graph, the ports are pointed at the buffers by applyPorts().
+*/
+static void layoutPorts(Graph *g, int steps) {
+    // Round up to a multiple of 64 bytes
+    size_t stride = (steps + 1 + 15) & ~(size_t) 15;
+    std::unordered_map<const Output*, float*> queues;
+    for (Wire *wire : g->wires)
+        queues[&wire->outputModule->outputs[wire->outputId]] = NULL;
+
+    g->pool.assign(queues.size() * stride, 0.f);
+    g->silence.assign(stride, 0.f);
+    size_t offset = 0;
+    auto placeOutputs = [&](Module *module) {
+        for (Output &out : module->outputs) {
+            auto it = queues.find(&out);
+            if (it == queues.end())
+                continue;
+            it->second = &g->pool[offset];
+            offset += stride;
+        }
+    };
+    g->carriedQueues.clear();
+    for (Task &task : g->tasks) {
+        for (Module *module : task.modules)
+            placeOutputs(module);
+    }
+    for (size_t carried = 0; carried < offset; carried += stride)
+        g->carriedQueues.push_back(&g->pool[carried]);
+    // Suspended outputs keep their last sample in queue[0] for when they are resumed
+    for (Module *module : g->suspendedModules)
+        placeOutputs(module);
+
+    std::unordered_map<const Input*, const float*> blocks;
+    for (const Link &link : g->links) {
+        const Input *in = &link.inputModule->inputs[link.inputId];
+        blocks[in] = link.outputModule ? queues[&link.outputModule->outputs[link.outputId]] : g->silence.data();
+    }
+
+    g->outputQueues.clear();
+    g->inputBlocks.clear();
+    for (Module *module : g->modules) {
+        for (Output &out : module->outputs) {
+            auto it = queues.find(&out);
+            g->outputQueues.push_back(it != queues.end() ? it->second : NULL);
+        }
+        for (Input &in : module->inputs) {
+            auto it = blocks.find(&in);
+            g->inputBlocks.push_back(it != blocks.end() ? it->second : g->silence.data());
+        }
+    }
+    g->steps = steps;
+}
+
+/** Updates the connectivity masks of the module, notifying it if they changed */
+static void setConnected(Module *module, uint64_t connectedInputs, uint64_t connectedOutputs) {
+    if (module->connectedInputs == connectedInputs && module->connectedOutputs == connectedOutputs)
+        return;
+    module->connectedInputs = connectedInputs;
+    module->connectedOutputs = connectedOutputs;
+    module->onPortChange();
+}
+
+/** Points the ports of the graph's modules at its buffers, carrying over the last sample of each output, updates their connectivity masks and detaches the removed modules.
+Must be called while no block is running and after the last sample of the previous block has been carried to queue[0].
+*/
+static void applyPorts(Graph *g) {
+    size_t o = 0;
+    size_t i = 0;
+    for (Module *module : g->modules) {
+        uint64_t connectedOutputs = 0;
+        uint64_t connectedInputs = 0;
+        for (size_t id = 0; id < module->outputs.size(); id++) {
+            Output &out = module->outputs[id];
+            float *queue = g->outputQueues[o++];
+            if (queue && out.queue)
+                queue[0] = out.queue[0];
+            out.queue = queue;
+            out.block = queue ? queue + 1 : NULL;
+            out.active = (queue != NULL);
+            if (out.active && id < 64)
+                connectedOutputs |= (uint64_t) 1 << id;
+        }
+        for (size_t id = 0; id < module->inputs.size(); id++) {
+            Input &in = module->inputs[id];
+            in.block = g->inputBlocks[i++];
+            bool active = (in.block != g->silence.data());
+            // Set unplugged inputs to 0V
+            if (in.active && !active)
+                in.value = 0.f;
+            in.active = active;
+            if (active && id < 64)
+                connectedInputs |= (uint64_t) 1 << id;
+        }
+        setConnected(module, connectedInputs, connectedOutputs);
+    }
+    for (Module *module : g->removedModules) {
+        for (Output &out : module->outputs) {
+            out.queue = NULL;
+            out.block = NULL;
+            out.active = false;
+        }
+        for (Input &in : module->inputs) {
+            in.block = NULL;
+            in.value = 0.f;
+            in.active = false;
+        }
+        setConnected(module, 0, 0);
+    }
+    // They may be deleted from now on
+    g->removedModules.clear();
+    portsOnValues = false;
+}
+
+/** Merges the tasks of single modules which share a ModuleBatch and a level into tasks of up to ModuleBatch::size modules.
+Tasks on the same level never depend on each other, so the merged task only has to wait for the union of their producers.
+Must be called once the levels are known, renumbers the tasks in level order.
+*/
+static void batchTasks(Graph *g) {
+    std::vector<Task> &tasks = g->tasks;
+    std::vector<int> order(tasks.size());
+    for (int t = 0; t < (int) tasks.size(); t++)
+        order[t] = t;
+    // Sorting by level keeps the topological order after merging
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return tasks[a].level < tasks[b].level;
+    });
+
+    std::vector<Task> merged;
+    std::vector<int> mergedIds(tasks.size());
+    // Task which is still filling up, for each kernel on the current level
+    std::unordered_map<const ModuleBatch*, int> open;
+    int level = -1;
+    for (int t : order) {
+        Task &task = tasks[t];
+        if (task.level != level) {
+            open.clear();
+            level = task.level;
+        }
+        const ModuleBatch *batch = task.cyclic ? NULL : task.modules[0]->batch;
+        if (batch) {
+            auto it = open.find(batch);
+            if (it != open.end()) {
+                Task &batchTask = merged[it->second];
+                batchTask.modules.push_back(task.modules[0]);
+                batchTask.batched = true;
+                mergedIds[t] = it->second;
+                if ((int) batchTask.modules.size() >= batch->size)
+                    open.erase(it);
+                continue;
+            }
+            if (batch->size > 1)
+                open[batch] = merged.size();
+        }
+        mergedIds[t] = merged.size();
+        Task copy;
+        copy.modules = task.modules;
+        copy.level = task.level;
+        copy.cyclic = task.cyclic;
+        merged.push_back(copy);
+    }
+    // Keep the original order if nothing was merged
+    if (merged.size() == tasks.size())
+        return;
+
+    for (int t = 0; t < (int) tasks.size(); t++) {
+        Task &task = merged[mergedIds[t]];
+        for (int s : tasks[t].successors) {
+            int successor = mergedIds[s];
+            if (std::find(task.successors.begin(), task.successors.end(), successor) != task.successors.end())
+                continue;
+            task.successors.push_back(successor);
+            merged[successor].numDeps++;
+        }
+    }
+    for (auto &it : g->moduleTasks)
+        it.second = mergedIds[it.second];
+    tasks.swap(merged);
+}
+
+/** Moves the output end of the link from a bypassed module to the output feeding the routed input, until it reaches a module which isn't bypassed.
+Clears outputModule if the signal ends at a bypassed module without a route for it.
+*/
+static void resolveBypass(Link *link) {
+    // Bypassed modules may route into each other in a loop
+    for (size_t hops = 0; hops <= gModules.size(); hops++) {
+        Module *module = link->outputModule;
+        if (!module->bypassed)
+            return;
+        auto route = std::find_if(module->bypassRoutes.begin(), module->bypassRoutes.end(), [&](const Module::BypassRoute &route) {
+            return route.outputId == link->outputId;
+        });
+        if (route == module->bypassRoutes.end())
+            break;
+        auto it = inputWires.find(&module->inputs[route->inputId]);
+        if (it == inputWires.end())
+            break;
+        link->outputModule = it->second->outputModule;
+        link->outputId = it->second->outputId;
+    }
+    link->outputModule = NULL;
+}
+
+/** Flattens gModules and gWires into a new graph, with feedback loops collapsed into tasks which one worker steps sample-by-sample.
+Only reads the current graph, so it runs while the engine keeps stepping.
+*/
+static Graph *compileGraph() {
+    Graph *g = new Graph();
+    g->modules = gModules;
+    g->wires = gWires;
+    int n = g->modules.size();
+    std::unordered_map<Module*, int> moduleIds;
+    for (int i = 0; i < n; i++)
+        moduleIds[g->modules[i]] = i;
+
+    for (Wire *wire : g->wires) {
+        Link link;
+        link.outputModule = wire->outputModule;
+        link.outputId = wire->outputId;
+        link.inputModule = wire->inputModule;
+        link.inputId = wire->inputId;
+        resolveBypass(&link);
+        g->links.push_back(link);
+    }
+
+    // Distinct module-to-module edges
+    std::vector<std::vector<int>> successors(n);
+    for (const Link &link : g->links) {
+        if (!link.outputModule)
+            continue;
+        int from = moduleIds[link.outputModule];
+        int to = moduleIds[link.inputModule];
+        std::vector<int> &succ = successors[from];
+        if (std::find(succ.begin(), succ.end(), to) == succ.end())
+            succ.push_back(to);
+    }
+
+    // Only modules which lead to a sink are stepped, the others would compute signals which nothing reads.
+    // Sinks are modules without outputs, like audio interfaces and scopes, and modules with side effects.
+    // Modules which didn't opt in to being suspended, and modules with lights, are sinks as well, so they keep running unpatched.
+    // Bypassed modules have no links out of them and can't be sinks, so they are suspended as well.
+    std::vector<std::vector<int>> predecessors(n);
+    for (int i = 0; i < n; i++) {
+        for (int j : successors[i])
+            predecessors[j].push_back(i);
+    }
+    std::vector<bool> reached(n, false);
+    std::vector<int> frontier;
+    for (int i = 0; i < n; i++) {
+        Module *module = g->modules[i];
+        bool suspendable = (module->suspendable || module->pure) && module->lights.empty();
+        if (module->outputs.empty() || module->sideEffects || (!suspendable && !module->bypassed)) {
+            reached[i] = true;
+            frontier.push_back(i);
+        }
+    }
+    while (!frontier.empty()) {
+        int j = frontier.back();
+        frontier.pop_back();
+        for (int i : predecessors[j]) {
+            if (!reached[i]) {
+                reached[i] = true;
+                frontier.push_back(i);
+            }
+        }
+    }
+    // Suspended modules only feed other suspended modules, so dropping their edges leaves the stepped part of the graph intact
+    for (int i = 0; i < n; i++) {
+        std::vector<int> &succ = successors[i];
+        succ.erase(std::remove_if(succ.begin(), succ.end(), [&](int j) { return !reached[j]; }), succ.end());
+        if (!reached[i])
+            g->suspendedModules.push_back(g->modules[i]);
+    }
+
+    // Tarjan's algorithm, iterative so long chains don't overflow the stack.
+    // Strongly connected components are found in reverse topological order.
+    std::vector<std::vector<int>> components;
+    std::vector<int> index(n, -1);
+    std::vector<int> lowlink(n, 0);
+    std::vector<bool> onStack(n, false);
+    std::vector<int> stack;
+    std::vector<std::pair<int, size_t>> dfs;
+    int counter = 0;
+    for (int root = 0; root < n; root++) {
+        if (index[root] >= 0 || !reached[root])
+            continue;
+        index[root] = lowlink[root] = counter++;
+        stack.push_back(root);
+        onStack[root] = true;
+        dfs.push_back(std::make_pair(root, 0));
+
+        while (!dfs.empty()) {
+            int v = dfs.back().first;
+            if (dfs.back().second < successors[v].size()) {
+                int w = successors[v][dfs.back().second++];
+                if (index[w] < 0) {
+                    index[w] = lowlink[w] = counter++;
+                    stack.push_back(w);
+                    onStack[w] = true;
+                    dfs.push_back(std::make_pair(w, 0));
+                }
+                else if (onStack[w]) {
+                    lowlink[v] = std::min(lowlink[v], index[w]);
                 }
-                
-                module->step();
-
-                for (auto &out : module->outputs)
-                {
-                    for (Wire *w : out.wires)
-                    {
-                        *(volatile float*)(w->inputModule->inputs[w->inputId].queue + step + 1) = out.value;
-                        __sync_synchronize();
-                        w->inputModule->inputs[w->inputId].pos = step+1;
-                    }
-                }                   
+                continue;
             }
 
-            nope:;
+            dfs.pop_back();
+            if (!dfs.empty()) {
+                int u = dfs.back().first;
+                lowlink[u] = std::min(lowlink[u], lowlink[v]);
+            }
+            if (lowlink[v] == index[v]) {
+                components.push_back(std::vector<int>());
+                int w;
+                do {
+                    w = stack.back();
+                    stack.pop_back();
+                    onStack[w] = false;
+                    components.back().push_back(w);
+                } while (w != v);
+            }
         }
+    }
 
-        m.lock();
-        runningt--;
-        __sync_synchronize();
-        cond2.notify_all();
+    // Each component becomes a task. Feedback loops are collapsed into a single cyclic task which one worker steps sample-by-sample, and everything else is scheduled block-wise.
+    std::vector<Task> &tasks = g->tasks;
+    std::vector<int> taskIds(n, -1);
+    for (auto it = components.rbegin(); it != components.rend(); ++it) {
+        std::vector<int> &component = *it;
+        // Keep the rack order within a cycle
+        std::sort(component.begin(), component.end());
+        Task task;
+        for (int i : component) {
+            taskIds[i] = tasks.size();
+            task.modules.push_back(g->modules[i]);
+            g->moduleTasks[g->modules[i]] = tasks.size();
+        }
+        int first = component[0];
+        task.cyclic = component.size() > 1 || std::find(successors[first].begin(), successors[first].end(), first) != successors[first].end();
+        tasks.push_back(task);
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (taskIds[i] < 0)
+            continue;
+        Task &task = tasks[taskIds[i]];
+        for (int j : successors[i]) {
+            int t = taskIds[j];
+            if (t == taskIds[i] || std::find(task.successors.begin(), task.successors.end(), t) != task.successors.end())
+                continue;
+            task.successors.push_back(t);
+            tasks[t].numDeps++;
+        }
+    }
+
+    // Tasks were created in topological order
+    for (int t = 0; t < (int) tasks.size(); t++) {
+        for (int s : tasks[t].successors)
+            tasks[s].level = std::max(tasks[s].level, tasks[t].level + 1);
+    }
+    batchTasks(g);
+    for (int t = 0; t < (int) tasks.size(); t++) {
+        if (tasks[t].numDeps == 0)
+            g->rootTasks.push_back(t);
+        for (Module *module : tasks[t].modules)
+            tasks[t].quality |= (module->qualityLevels > 1);
+    }
+
+    // Only outputs read by modules which use Input::constant are checked. Inputs within a cycle are produced during the block, so they are never constant.
+    std::unordered_map<const Input*, Output*> sources;
+    for (const Link &link : g->links) {
+        if (link.outputModule)
+            sources[&link.inputModule->inputs[link.inputId]] = &link.outputModule->outputs[link.outputId];
+    }
+    std::unordered_set<const Output*> checked;
+    for (Task &task : tasks) {
+        if (task.cyclic)
+            continue;
+        for (Module *module : task.modules) {
+            bool reads = module->pure || module->readsConstant;
+            for (const Input &in : module->inputs) {
+                auto it = sources.find(&in);
+                Output *source = (reads && it != sources.end()) ? it->second : NULL;
+                if (source)
+                    checked.insert(source);
+                task.inputSources.push_back(source);
+            }
+        }
+    }
+    for (Task &task : tasks) {
+        for (Module *module : task.modules) {
+            for (Output &out : module->outputs) {
+                if (checked.count(&out))
+                    task.checkedOutputs.push_back(&out);
+            }
+        }
+    }
+
+    if (threadConfig.prefault) {
+        // The audio thread fills these during the block
+        for (Task &task : tasks) {
+            task.events.reserve(2 * rampFrames);
+            task.ticks.reserve(task.modules.size());
+        }
+    }
+
+    g->taskPending.reset(new std::atomic<int>[tasks.size()]);
+    layoutPorts(g, std::max(lastSteps.load(), 1));
+
+    for (Module *module : graph.load()->modules) {
+        if (!moduleIds.count(module))
+            g->removedModules.push_back(module);
+    }
+    info("Engine schedule: %d modules in %d tasks, %d roots, %d suspended", n, (int) tasks.size(), (int) g->rootTasks.size(), (int) g->suspendedModules.size());
+    return g;
+}
+
+/** Must be called with `m` locked and no block running */
+static void startWorkers() {
+#ifndef ARCH_WEB
+    int count = threadCountSetting;
+    // Leave a core to the audio thread, which runs the device callback while the workers step the next block
+    if (count <= 0)
+        count = (int) std::thread::hardware_concurrency() - 1;
+    count = std::max(count, 1);
+
+    for (int i = 0; i < count; i++) {
+        Worker *worker = new Worker();
+        worker->id = i;
+        worker->blockId = blockId.load();
+        worker->deque.reset(graph.load()->tasks.size());
+        worker->thread = new tthread::thread((void(*)(void*)) do_work, worker);
+        workers.push_back(worker);
+    }
+    numWorkers = count;
+    info("Started %d DSP thread(s)", numWorkers);
+#endif
+}
+
+/** Must be called with `m` locked and no block running. Unlocks `m` while joining the threads. */
+static void stopWorkers() {
+    // Until new workers are started, engineStepMT runs blocks on the calling thread
+    numWorkers = 0;
+    std::vector<Worker*> stopping;
+    stopping.swap(workers);
+    for (Worker *worker : stopping)
+        worker->quit.store(true, std::memory_order_release);
+    blockParker.wake();
+
+    m.unlock();
+    for (Worker *worker : stopping) {
+        worker->thread->join();
+        delete worker->thread;
+        delete worker;
     }
+    m.lock();
 }
 
 void engineInit() {
     engineSetSampleRate(48000.0);
+    calibrateTicks();
+    spinTicks.store(threadConfig.spinTime * ticksPerSecond);
 
-#ifndef ARCH_WEB
-#ifndef ARCH_WIN
-    numWorkers = 3;
-#else
-    numWorkers = 1;
-#endif
-    for (int i = 0; i < numWorkers; i++) {
-        ptoks[i] = new moodycamel::ProducerToken(q);
-        ctoks[i] = new moodycamel::ConsumerToken(q);
-        (new tthread::thread((void(*)(void*))do_work, (void*)i))->detach();
+    m.lock();
+    startWorkers();
+    m.unlock();
+}
+
+void engineSetThreadCount(int count) {
+    m.lock();
+    waitBlock();
+
+    threadCountSetting = count;
+    if (!workers.empty()) {
+        stopWorkers();
+        // A block may have been started on the calling thread in the meantime
+        waitBlock();
+        startWorkers();
     }
-    info("Started %d DSP thread(s)", numWorkers);
+    m.unlock();
+}
+
+int engineGetThreadCount() {
+    return numWorkers;
+}
+
+void engineSetThreadConfig(const EngineThreadConfig &config) {
+    m.lock();
+    waitBlock();
+
+    bool wasLocked = threadConfig.lockMemory;
+    // The workers read the config while they set themselves up, so it is only replaced while none are running
+    bool restart = !workers.empty();
+    if (restart) {
+        stopWorkers();
+        waitBlock();
+    }
+    threadConfig = config;
+    spinTicks.store(std::max(config.spinTime, 0.f) * ticksPerSecond);
+    if (config.prefault) {
+        // Room for the param changes of a busy block, so the audio thread doesn't allocate them
+        pendingParams.reserve(1024);
+        paramRamps.reserve(256);
+    }
+    if (restart)
+        startWorkers();
+    m.unlock();
+
+    if (config.lockMemory) {
+        lockMemory();
+    }
+    else if (wasLocked) {
+#if ARCH_LIN || ARCH_MAC
+        munlockall();
 #endif
+    }
+}
+
+EngineThreadConfig engineGetThreadConfig() {
+    return threadConfig;
+}
+
+EngineBarrierStats engineGetBarrierStats() {
+    return barrierStats;
+}
+
+EngineLoadStats engineGetLoadStats() {
+    return loadStats;
 }
 
 void engineDestroy() {
     // Make sure there are no wires or modules in the rack on destruction. This suggests that a module failed to remove itself before the WINDOW was destroyed.
     assert(gWires.empty());
     assert(gModules.empty());
+
+    m.lock();
+    waitBlock();
+    stopWorkers();
+    m.unlock();
 }
 
-void engineStep() {
-    // Param interpolation
-    if (smoothModule) {
-        float value = smoothModule->params[smoothParamId].value;
-        const float lambda = 60.0; // decay rate is 1 graphics frame
-        float delta = smoothValue - value;
-        float newValue = value + delta * lambda * sampleTime;
-        if (value == newValue) {
-            // Snap to actual smooth value if the value doesn't change enough (due to the granularity of floats)
-            smoothModule->params[smoothParamId].value = smoothValue;
-            smoothModule = NULL;
+static std::vector<ParamRamp>::iterator findRamp(Module *module, int paramId) {
+    for (auto it = paramRamps.begin(); it != paramRamps.end(); ++it) {
+        if (it->module == module && it->paramId == paramId)
+            return it;
+    }
+    return paramRamps.end();
+}
+
+/** Starts moving a param towards the value of a ramped event, from where its current ramp is if it has one */
+static void startRamp(const ParamEvent &event) {
+    auto it = findRamp(event.module, event.paramId);
+    if (it == paramRamps.end()) {
+        ParamRamp ramp;
+        ramp.module = event.module;
+        ramp.paramId = event.paramId;
+        ramp.value = event.module->params[event.paramId].value;
+        paramRamps.push_back(ramp);
+        it = paramRamps.end() - 1;
+    }
+    it->target = event.value;
+    it->framesLeft = std::max((int) roundf(event.rampTime * sampleRate), 1);
+    it->delta = (it->target - it->value) / it->framesLeft;
+}
+
+static void stopRamp(Module *module, int paramId) {
+    auto it = findRamp(module, paramId);
+    if (it != paramRamps.end()) {
+        *it = paramRamps.back();
+        paramRamps.pop_back();
+    }
+}
+
+/** Inserts an event into the task, keeping the events sorted by frame and in order of arrival within a frame */
+static void pushTaskEvent(Task &task, const ParamEvent &event) {
+    auto pos = task.events.end();
+    while (pos != task.events.begin() && (pos - 1)->frame > event.frame)
+        --pos;
+    task.events.insert(pos, event);
+}
+
+static void drainParams() {
+    ParamEvent events[64];
+    size_t count;
+    while ((count = paramQueue.try_dequeue_bulk(events, 64)) > 0)
+        pendingParams.insert(pendingParams.end(), events, events + count);
+}
+
+/** Hands the param changes due within the next `steps` frames to the tasks of `g`, or sets them right away if `direct`.
+Must be called with no block running.
+*/
+static void dispatchParams(Graph *g, int steps, bool direct) {
+    drainParams();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < pendingParams.size(); i++) {
+        ParamEvent event = pendingParams[i];
+        if (event.rampTime > 0.f) {
+            startRamp(event);
+            continue;
+        }
+        auto it = g->moduleTasks.find(event.module);
+        // Modules which are not added yet aren't stepped, so they can be set immediately
+        bool stepped = (it != g->moduleTasks.end());
+        if (stepped && event.frame >= steps) {
+            event.frame -= steps;
+            pendingParams[kept++] = event;
+            continue;
+        }
+        // Setting a param interrupts its ramp
+        if (!paramRamps.empty())
+            stopRamp(event.module, event.paramId);
+        if (!stepped || direct) {
+            event.module->params[event.paramId].value = event.value;
+            continue;
+        }
+        pushTaskEvent(g->tasks[it->second], event);
+    }
+    pendingParams.resize(kept);
+}
+
+/** Moves the ramps by `steps` frames and hands their values to the tasks of `g` every `rampFrames` frames, or sets them right away if `direct`.
+The cost only depends on the number of ramps, which are dropped once they reach their target.
+Must be called with no block running.
+*/
+static void advanceRamps(Graph *g, int steps, bool direct) {
+    int subFrames = std::min(rampFrames, steps);
+    size_t i = 0;
+    while (i < paramRamps.size()) {
+        ParamRamp &ramp = paramRamps[i];
+        auto it = g->moduleTasks.find(ramp.module);
+        if (it == g->moduleTasks.end() || direct) {
+            // Nothing is stepping the module in between, so only the value at the end of the block matters
+            int frames = (it == g->moduleTasks.end()) ? ramp.framesLeft : std::min(steps, ramp.framesLeft);
+            ramp.framesLeft -= frames;
+            ramp.value = (ramp.framesLeft > 0) ? ramp.value + ramp.delta * frames : ramp.target;
+            ramp.module->params[ramp.paramId].value = ramp.value;
+        }
+        else {
+            ParamEvent event;
+            event.module = ramp.module;
+            event.paramId = ramp.paramId;
+            event.rampTime = 0.f;
+            for (int frame = 0; frame < steps && ramp.framesLeft > 0; frame += subFrames) {
+                int frames = std::min(subFrames, ramp.framesLeft);
+                ramp.framesLeft -= frames;
+                ramp.value = (ramp.framesLeft > 0) ? ramp.value + ramp.delta * frames : ramp.target;
+                event.value = ramp.value;
+                event.frame = frame;
+                pushTaskEvent(g->tasks[it->second], event);
+            }
+        }
+
+        if (ramp.framesLeft <= 0) {
+            ramp = paramRamps.back();
+            paramRamps.pop_back();
         }
         else {
-            smoothModule->params[smoothParamId].value = newValue;
+            i++;
         }
     }
+}
 
-    // Step modules
-    for (Module *module : gModules) {
-        module->step();
-
-        // TODO skip this step when plug lights are disabled
-        // Step ports
-        /*for (Input &input : module->inputs) {
-            if (input.active) {
-                float value = input.value / 5.f;
-                // input.plugLights[0].setBrightnessSmooth(value);
-                // input.plugLights[1].setBrightnessSmooth(-value);
-                input.plugLights[0].setBrightnessSmooth(value > 0);
-                input.plugLights[1].setBrightnessSmooth(value < 0);
+/** Sets the param changes of modules which `g` doesn't step anymore while they still exist.
+Must be called with no block running.
+*/
+static void flushRemovedParams(Graph *g) {
+    drainParams();
+
+    size_t kept = 0;
+    for (size_t i = 0; i < pendingParams.size(); i++) {
+        const ParamEvent &event = pendingParams[i];
+        if (g->moduleTasks.count(event.module))
+            pendingParams[kept++] = event;
+        else
+            event.module->params[event.paramId].value = event.value;
+    }
+    pendingParams.resize(kept);
+
+    // Removed modules skip to the end of their ramps
+    kept = 0;
+    for (size_t i = 0; i < paramRamps.size(); i++) {
+        const ParamRamp &ramp = paramRamps[i];
+        if (g->moduleTasks.count(ramp.module))
+            paramRamps[kept++] = ramp;
+        else
+            ramp.module->params[ramp.paramId].value = ramp.target;
+    }
+    paramRamps.resize(kept);
+}
+
+void engineStep() {
+    initThreadFlushToZero("engine");
+    Graph *g = graph.load(std::memory_order_acquire);
+    dispatchParams(g, 1, true);
+    advanceRamps(g, 1, true);
+
+    // Process one frame at a time, directly on the port values
+    if (!portsOnValues) {
+        for (Module *module : g->modules) {
+            for (Input &in : module->inputs) {
+                in.block = &in.value;
+                // Blocks of one frame are constant
+                in.constant = true;
             }
+            for (Output &out : module->outputs)
+                out.block = &out.value;
         }
-        for (Output &output : module->outputs) {
-            if (output.active) {
-                float value = output.value / 5.f;
-                // output.plugLights[0].setBrightnessSmooth(value);
-                // output.plugLights[1].setBrightnessSmooth(-value);
-                output.plugLights[0].setBrightnessSmooth(value > 0);
-                output.plugLights[1].setBrightnessSmooth(value < 0);                
+        portsOnValues = true;
+    }
+    Module::ProcessArgs args;
+    args.sampleRate = sampleRate;
+    args.sampleTime = sampleTime;
+
+    // Step modules
+    for (Task &task : g->tasks) {
+        for (Module *module : task.modules) {
+            module->process(args, 1);
+
+            // TODO skip this step when plug lights are disabled
+            // Step ports
+            /*for (Input &input : module->inputs) {
+                if (input.active) {
+                    float value = input.value / 5.f;
+                    // input.plugLights[0].setBrightnessSmooth(value);
+                    // input.plugLights[1].setBrightnessSmooth(-value);
+                    input.plugLights[0].setBrightnessSmooth(value > 0);
+                    input.plugLights[1].setBrightnessSmooth(value < 0);
+                }
             }
-        }*/
+            for (Output &output : module->outputs) {
+                if (output.active) {
+                    float value = output.value / 5.f;
+                    // output.plugLights[0].setBrightnessSmooth(value);
+                    // output.plugLights[1].setBrightnessSmooth(-value);
+                    output.plugLights[0].setBrightnessSmooth(value > 0);
+                    output.plugLights[1].setBrightnessSmooth(value < 0);                
+                }
+            }*/
+        }
     }
 
     // Step cables by moving their output values to inputs
-    for (Wire *wire : gWires) {
-        wire->step();
+    for (const Link &link : g->links) {
+        Input &in = link.inputModule->inputs[link.inputId];
+        in.value = link.outputModule ? link.outputModule->outputs[link.outputId].value : 0.f;
     }
 }
 
+/** Moves the last sample of the previous block to queue[0] of every stepped output.
+Must be called with `m` locked and no block running.
+*/
+static void carryOutputs(Graph *g) {
+    for (float *queue : g->carriedQueues)
+        queue[0] = queue[runningSteps];
+    // Carrying again before the next block must not overwrite it
+    runningSteps = 0;
+}
+
 void engineStepMT(int steps) {
-    if (smoothModule) {
-        float value = smoothModule->params[smoothParamId].value;
-        const float lambda = 30.0; // decay rate is 1 graphics frame
-        float delta = smoothValue - value;
-        float newValue = value + delta * lambda * sampleTime * steps;
-        if (value == newValue) {
-            // Snap to actual smooth value if the value doesn't change enough (due to the granularity of floats)
-            smoothModule->params[smoothParamId].value = smoothValue;
-            smoothModule = NULL;
-        }
-        else {
-            smoothModule->params[smoothParamId].value = newValue;
-        }
-    }
+    // The caller runs the blocks itself while the pool is resized
+    initThreadFlushToZero("audio");
+    lastSteps.store(steps, std::memory_order_relaxed);
 
-    // Enqueue module steps
     m.lock();
-    Module *outm = NULL;
-    for (Module *module : gModules) {
-        /*if(module->outputs.size() == 0 && !outm)
-        {
-            for (Input &in : module->inputs)
-                in.queue[0] = in.queue[steps];
-            outm = module;
-            continue;
-        }*/
+    Graph *g = graph.load(std::memory_order_acquire);
+    carryOutputs(g);
+
+    dispatchParams(g, steps, false);
+    advanceRamps(g, steps, false);
+
+    // Grow the buffers if the block size increased since the graph was compiled
+    if (steps > g->steps) {
+        std::vector<float> pool;
+        std::vector<float> silence;
+        pool.swap(g->pool);
+        silence.swap(g->silence);
+        layoutPorts(g, steps);
+        // The old buffers are only released after the carried samples are copied
+        applyPorts(g);
+    }
+    else if (portsOnValues) {
+        applyPorts(g);
+    }
 
-        for (Input &in : module->inputs) {
-            in.pos = in.active ? 0 : steps-1;
-            in.queue[0] = in.queue[steps];
-        }
+    runningSteps = steps;
 
-        UOW uow = { module, 0, steps };
-        q.enqueue(*ptoks[0], uow);
+    // No workers while the pool is being resized, so run the block right here. Tasks are stored in topological order.
+    if (numWorkers == 0) {
+        for (Task &task : g->tasks)
+            runTask(task, steps);
+        m.unlock();
+        return;
     }
 
-    runningt = numWorkers;
-    __sync_synchronize();
+    // Push only the tasks without dependencies, spread over the workers. The rest are pushed by the workers as their producers finish.
+    for (int t = 0; t < (int) g->tasks.size(); t++)
+        g->taskPending[t].store(g->tasks[t].numDeps, std::memory_order_relaxed);
+    tasksLeft.store(g->tasks.size(), std::memory_order_relaxed);
+    readyTasks.store(g->rootTasks.size(), std::memory_order_relaxed);
+    for (Worker *worker : workers)
+        worker->deque.reset(g->tasks.size());
+    for (size_t i = 0; i < g->rootTasks.size(); i++)
+        workers[i % workers.size()]->deque.push(g->rootTasks[i]);
+
+    runningt.store(numWorkers, std::memory_order_relaxed);
+    blockStartTicks = readTicks();
+    blockId.fetch_add(1, std::memory_order_release);
     m.unlock();
-    cond.notify_all();
+    blockParker.wake();
+}
 
-    /*if (outm)
-    {
-        for (int step = 0; step < steps; step++)
-        {
-            for (auto &in : outm->inputs)
-                in.value = in.queue[step];
-            outm->step();
-        }
-    }*/
+/** Accumulates the handoff delays of the last block into barrierStats. Must be called with `m` locked and no block running. */
+static void updateBarrierStats() {
+    uint64_t now = readTicks();
+    uint64_t wakeTicks = 0;
+    uint64_t doneTicks = 0;
+    for (Worker *worker : workers) {
+        // Workers started after the block didn't take part in it
+        if (worker->wakeTicks < blockStartTicks)
+            continue;
+        wakeTicks = std::max(wakeTicks, worker->wakeTicks - blockStartTicks);
+        doneTicks = std::max(doneTicks, worker->doneTicks);
+    }
+    float wakeLatency = wakeTicks / ticksPerSecond;
+    float completionLatency = (doneTicks > 0 && now > doneTicks) ? (now - doneTicks) / ticksPerSecond : 0.f;
+    unsigned waits = blockParker.waits.exchange(0) + doneParker.waits.exchange(0);
+    unsigned parks = blockParker.parks.exchange(0) + doneParker.parks.exchange(0);
+    float parkRatio = waits > 0 ? (float) parks / waits : 0.f;
+
+    // Average over roughly 100 blocks and let the peaks fall over a few thousand
+    const float lambda = 0.01f;
+    const float peakDecay = 0.999f;
+    EngineBarrierStats &stats = barrierStats;
+    stats.wakeLatency += (wakeLatency - stats.wakeLatency) * lambda;
+    stats.wakeLatencyPeak = std::max(wakeLatency, stats.wakeLatencyPeak * peakDecay);
+    stats.completionLatency += (completionLatency - stats.completionLatency) * lambda;
+    stats.completionLatencyPeak = std::max(completionLatency, stats.completionLatencyPeak * peakDecay);
+    stats.parkRatio += (parkRatio - stats.parkRatio) * lambda;
 }
 
-void engineWaitMT() {
-    static bool primed = false;
+/** Sets the quality level of a module and notifies it */
+static void setQuality(Module *module, int quality) {
+    module->quality = quality;
+    module->onQualityChange();
+}
 
-    if (!primed) {
-        primed = true;
+/** Lowers the quality of the heaviest module while the smoothed block load is close to the deadline, and restores the last lowered one once there has been headroom for a while.
+Must be called with `m` locked and no block running.
+*/
+static void updateQuality() {
+    const float degradeLoad = 0.8f;
+    const float restoreLoad = 0.5f;
+    const float degradeInterval = 0.25f;
+    const float restoreInterval = 2.f;
+
+    uint64_t doneTicks = 0;
+    for (Worker *worker : workers)
+        doneTicks = std::max(doneTicks, worker->doneTicks);
+    if (doneTicks < blockStartTicks || runningSteps == 0)
         return;
+    float blockTime = runningSteps * sampleTime;
+    float load = (float) ((doneTicks - blockStartTicks) / ticksPerSecond) / blockTime;
+    if (load > 1.f)
+        loadStats.deadlineMisses++;
+    // Smooth over a fraction of a second, so a single late block doesn't lower the quality but a rising load does soon
+    loadStats.load += (load - loadStats.load) * std::min(blockTime / 0.2f, 1.f);
+    qualityHoldTime += blockTime;
+
+    if (!gAdaptiveQuality) {
+        for (Module *module : degradedModules)
+            setQuality(module, module->quality - 1);
+        degradedModules.clear();
+    }
+    else if (loadStats.load > degradeLoad && qualityHoldTime >= degradeInterval) {
+        // Only stepped modules have a CPU time
+        Module *heaviest = NULL;
+        for (Task &task : graph.load(std::memory_order_relaxed)->tasks) {
+            if (!task.quality)
+                continue;
+            for (Module *module : task.modules) {
+                if (module->quality + 1 < module->qualityLevels && (!heaviest || module->cpuTime > heaviest->cpuTime))
+                    heaviest = module;
+            }
+        }
+        if (heaviest) {
+            setQuality(heaviest, heaviest->quality + 1);
+            degradedModules.push_back(heaviest);
+            qualityHoldTime = 0.f;
+        }
+    }
+    else if (loadStats.load < restoreLoad && qualityHoldTime >= restoreInterval && !degradedModules.empty()) {
+        Module *module = degradedModules.back();
+        degradedModules.pop_back();
+        setQuality(module, module->quality - 1);
+        qualityHoldTime = 0.f;
     }
+    loadStats.degradedLevels = degradedModules.size();
+}
 
+/** Accounts the last block of engineStepMT() once. Must be called with `m` locked and no block running. */
+static void finishBlock() {
+    if (statsBlockId == blockId.load(std::memory_order_relaxed) || workers.empty())
+        return;
+    statsBlockId = blockId.load(std::memory_order_relaxed);
+    updateBarrierStats();
+    updateQuality();
+}
+
+void engineWaitMT() {
+    // Returns right away if no block was started
+    waitBlock();
+    m.lock();
+    finishBlock();
+    m.unlock();
+}
+
+bool engineWaitMTFor(float timeout) {
+    auto done = []() {
+        return runningt.load(std::memory_order_acquire) == 0;
+    };
+    if (!done()) {
+        // Spins and yields instead of parking, since tthread::condition_variable has no timed wait. The caller would be idle until the deadline anyway.
+        uint64_t startTicks = readTicks();
+        uint64_t timeoutTicks = (uint64_t) (timeout * ticksPerSecond);
+        while (!done()) {
+            uint64_t ticks = readTicks() - startTicks;
+            if (ticks >= timeoutTicks)
+                return false;
+            if (ticks < spinTicks.load(std::memory_order_relaxed))
+                cpuRelax();
+            else
+                std::this_thread::yield();
+        }
+    }
     m.lock();
-    while(runningt > 0)
-        cond2.wait(m);
-    m.unlock(); 
+    finishBlock();
+    m.unlock();
+    return true;
 }
 
 static void engineRun() {
@@ -319,12 +1772,7 @@ void engineStart() {
     // running = true;
     // thread = std::thread(engineRun);
 
-#if !(defined(__arm__) || defined(__aarch64__) || defined(ARCH_WEB))
-    // Set CPU to flush-to-zero (FTZ) and denormals-are-zero (DAZ) mode
-    // https://software.intel.com/en-us/node/682949
-    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-    _MM_SET_DENORMALS_ZERO_MODE(_MM_DENORMALS_ZERO_ON);
-#endif
+    initThreadFlushToZero("main");
 }
 
 void engineStop() {
@@ -332,60 +1780,135 @@ void engineStop() {
     // thread.join();
 }
 
-void engineAddModule(Module *module) {
-    assert(module);
+void engineBeginTransaction() {
+    transactionDepth++;
+}
 
-    // Check that the module is not already added
-    auto it = std::find(gModules.begin(), gModules.end(), module);
-    assert(it == gModules.end());
+void engineCommitTransaction() {
+    assert(transactionDepth > 0);
+    if (--transactionDepth > 0)
+        return;
 
-    m.lock();
-    while(runningt)
-        cond2.wait(m);
+    if (!removingModules.empty()) {
+        gModules.erase(std::remove_if(gModules.begin(), gModules.end(), [](Module *module) {
+            return removingModules.count(module) > 0;
+        }), gModules.end());
+        removingModules.clear();
+    }
+    if (!removingWires.empty()) {
+        gWires.erase(std::remove_if(gWires.begin(), gWires.end(), [](Wire *wire) {
+            return removingWires.count(wire) > 0;
+        }), gWires.end());
+        removingWires.clear();
+    }
+
+    if (graphDirty) {
+        graphDirty = false;
+        engineNotifyLive();
+        // Compile without holding the lock, the engine keeps stepping the old graph meanwhile
+        Graph *newGraph = compileGraph();
+
+        m.lock();
+        waitBlock();
+        Graph *oldGraph = graph.load(std::memory_order_relaxed);
+        carryOutputs(oldGraph);
+        // Modules which aren't stepped anymore get their param changes set right away, after the queued ones are flushed below
+        for (Module *module : newGraph->removedModules)
+            module->stepped.store(false, std::memory_order_release);
+        for (Module *module : newGraph->suspendedModules)
+            module->stepped.store(false, std::memory_order_release);
+        for (auto &it : newGraph->moduleTasks)
+            it.first->stepped.store(true, std::memory_order_release);
+        flushRemovedParams(newGraph);
+        // Removed modules go back to full quality, in case they are added again
+        for (Module *module : newGraph->removedModules) {
+            auto it = std::find(degradedModules.begin(), degradedModules.end(), module);
+            if (it == degradedModules.end())
+                continue;
+            degradedModules.erase(std::remove(it, degradedModules.end(), module), degradedModules.end());
+            setQuality(module, 0);
+        }
+        applyPorts(newGraph);
+        graph.store(newGraph, std::memory_order_release);
+        // Suspended modules don't use any CPU
+        for (Module *module : newGraph->suspendedModules) {
+            module->cpuTime = 0.f;
+            module->cpuPeak = 0.f;
+        }
+        m.unlock();
 
-    gModules.push_back(module);
-    m.unlock(); 
+        delete oldGraph;
+    }
+
+    // Nothing steps the removed modules and wires anymore
+    for (Wire *wire : deletedWires)
+        delete wire;
+    deletedWires.clear();
+    for (Module *module : deletedModules)
+        delete module;
+    deletedModules.clear();
+
+    // Modules added by the transaction may have allocated memory which isn't locked yet
+    if (threadConfig.lockMemory)
+        lockMemory();
 }
 
-void engineRemoveModule(Module *module) {
+void engineAddModule(Module *module) {
     assert(module);
 
-    // If a param is being smoothed on this module, stop smoothing it immediately
-    if (module == smoothModule) {
-        smoothModule = NULL;
+    engineBeginTransaction();
+    // A module removed earlier in the transaction is still in gModules
+    if (!removingModules.erase(module)) {
+        // Check that the module is not already added
+        assert(std::find(gModules.begin(), gModules.end(), module) == gModules.end());
+        gModules.push_back(module);
     }
+    graphDirty = true;
+    engineCommitTransaction();
+}
+
+void engineRemoveModule(Module *module) {
+    assert(module);
+
     // Check that all wires are disconnected
-    for (Wire *wire : gWires) {
-        assert(wire->outputModule != module);
-        assert(wire->inputModule != module);
+    for (Input &input : module->inputs) {
+        assert(!inputWires.count(&input));
+    }
+    for (Output &output : module->outputs) {
+        assert(output.wires.empty());
     }
     // Check that the module actually exists
-    auto it = std::find(gModules.begin(), gModules.end(), module);
-    assert(it != gModules.end());
-    // Remove it
-    m.lock();
-    while(runningt)
-        cond2.wait(m);
+    assert(std::find(gModules.begin(), gModules.end(), module) != gModules.end() && !removingModules.count(module));
+    // Remove it once the transaction is committed
+    engineBeginTransaction();
+    removingModules.insert(module);
+    graphDirty = true;
+    engineCommitTransaction();
+}
 
-    gModules.erase(it);
-    m.unlock(); 
+void engineDeleteModule(Module *module) {
+    engineBeginTransaction();
+    engineRemoveModule(module);
+    deletedModules.push_back(module);
+    engineCommitTransaction();
 }
 
-static void updateActive() {
-    // Set everything to inactive
-    for (Module *module : gModules) {
-        for (Input &input : module->inputs) {
-            input.active = false;
-        }
-        for (Output &output : module->outputs) {
-            output.active = false;
-        }
-    }
-    // Set inputs/outputs to active
-    for (Wire *wire : gWires) {
-        wire->outputModule->outputs[wire->outputId].active = true;
-        wire->inputModule->inputs[wire->inputId].active = true;
+void engineSetModuleBypass(Module *module, bool bypassed) {
+    assert(module);
+    if (module->bypassed == bypassed)
+        return;
+    if (bypassed && !engineCanBypassModule(module)) {
+        warn("Module with side effects or without outputs can't be bypassed");
+        return;
     }
+    engineBeginTransaction();
+    module->bypassed = bypassed;
+    graphDirty = true;
+    engineCommitTransaction();
+}
+
+bool engineCanBypassModule(Module *module) {
+    return !module->outputs.empty() && !module->sideEffects;
 }
 
 void engineAddWire(Wire *wire) {
@@ -394,60 +1917,114 @@ void engineAddWire(Wire *wire) {
     // Check wire properties
     assert(wire->outputModule);
     assert(wire->inputModule);
-    // Check that the wire is not already added, and that the input is not already used by another cable
-    for (Wire *wire2 : gWires) {
-        assert(wire2 != wire);
-        assert(!(wire2->inputModule == wire->inputModule && wire2->inputId == wire->inputId));
-    }
+    // Check that the input is not already used by another cable, which also covers adding the same wire twice
+    const Input *input = &wire->inputModule->inputs[wire->inputId];
+    assert(!inputWires.count(input));
 
     // Add the wire
-    m.lock();
-    while(runningt)
-        cond2.wait(m);
-
-    gWires.push_back(wire);
+    engineBeginTransaction();
+    // A wire removed earlier in the transaction is still in gWires
+    if (!removingWires.erase(wire))
+        gWires.push_back(wire);
+    inputWires[input] = wire;
     wire->outputModule->outputs[wire->outputId].wires.push_back(wire);
-    updateActive();
-    m.unlock();
+    graphDirty = true;
+    engineCommitTransaction();
 }
 
 void engineRemoveWire(Wire *wire) {
     assert(wire);
 
     // Check that the wire is already added
-    auto it = std::find(gWires.begin(), gWires.end(), wire);
+    auto it = inputWires.find(&wire->inputModule->inputs[wire->inputId]);
     auto it2 = std::find(wire->outputModule->outputs[wire->outputId].wires.begin(), wire->outputModule->outputs[wire->outputId].wires.end(), wire);
-    assert(it != gWires.end());
+    assert(it != inputWires.end() && it->second == wire);
 
-    // Remove the wire
-    m.lock();
-    while(runningt)
-        cond2.wait(m);
+    // Remove the wire. The input is set to 0V once the transaction is committed.
+    engineBeginTransaction();
+    removingWires.insert(wire);
+    inputWires.erase(it);
+    wire->outputModule->outputs[wire->outputId].wires.erase(it2);
+    graphDirty = true;
+    engineCommitTransaction();
+}
 
-    // Set input to 0V
-    wire->inputModule->inputs[wire->inputId].value = 0.0;
-    memset(wire->inputModule->inputs[wire->inputId].queue, 0, sizeof(wire->inputModule->inputs[wire->inputId].queue));
+void engineDeleteWire(Wire *wire) {
+    engineBeginTransaction();
+    engineRemoveWire(wire);
+    deletedWires.push_back(wire);
+    engineCommitTransaction();
+}
 
-    gWires.erase(it);
-    wire->outputModule->outputs[wire->outputId].wires.erase(it2);
-    updateActive();
-    m.unlock();
+void engineSetParam(Module *module, int paramId, float value, int frame) {
+    assert(0 <= paramId && paramId < (int) module->params.size());
+    assert(frame >= 0);
+    ParamEvent event;
+    event.module = module;
+    event.paramId = paramId;
+    event.value = value;
+    event.frame = frame;
+    event.rampTime = 0.f;
+    engineNotifyLive();
+    if (!module->stepped.load(std::memory_order_acquire)) {
+        module->params[paramId].value = value;
+        return;
+    }
+    paramQueue.enqueue(event);
 }
 
-void engineSetParam(Module *module, int paramId, float value) {
-    module->params[paramId].value = value;
+void engineSetParamSmooth(Module *module, int paramId, float value, float rampTime) {
+    assert(0 <= paramId && paramId < (int) module->params.size());
+    assert(rampTime > 0.f);
+    ParamEvent event;
+    event.module = module;
+    event.paramId = paramId;
+    event.value = value;
+    event.frame = 0;
+    event.rampTime = rampTime;
+    engineNotifyLive();
+    if (!module->stepped.load(std::memory_order_acquire)) {
+        module->params[paramId].value = value;
+        return;
+    }
+    paramQueue.enqueue(event);
 }
 
-void engineSetParamSmooth(Module *module, int paramId, float value) {
-    // VIPLock vipLock(vipMutex);
-    // std::lock_guard<std::mutex> lock(mutex);
-    // Since only one param can be smoothed at a time, if another param is currently being smoothed, skip to its final state
-    if (smoothModule && !(smoothModule == module && smoothParamId == paramId)) {
-        smoothModule->params[smoothParamId].value = smoothValue;
+void engineFlushParams(Module *module) {
+    // The changes of modules which aren't stepped were already set
+    if (!module->stepped.load(std::memory_order_acquire))
+        return;
+    m.lock();
+    waitBlock();
+    drainParams();
+    // Ramps first, since a later change interrupts them
+    size_t kept = 0;
+    for (size_t i = 0; i < paramRamps.size(); i++) {
+        const ParamRamp &ramp = paramRamps[i];
+        if (ramp.module == module)
+            module->params[ramp.paramId].value = ramp.target;
+        else
+            paramRamps[kept++] = ramp;
     }
-    smoothModule = module;
-    smoothParamId = paramId;
-    smoothValue = value;
+    paramRamps.resize(kept);
+    kept = 0;
+    for (size_t i = 0; i < pendingParams.size(); i++) {
+        const ParamEvent &event = pendingParams[i];
+        if (event.module == module)
+            module->params[event.paramId].value = event.value;
+        else
+            pendingParams[kept++] = event;
+    }
+    pendingParams.resize(kept);
+    m.unlock();
+}
+
+void engineNotifyLive() {
+    liveCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned engineGetLiveCount() {
+    return liveCount.load(std::memory_order_relaxed);
 }
 
 void engineSetSampleRate(float newSampleRate) {
@@ -458,8 +2035,7 @@ void engineSetSampleRate(float newSampleRate) {
 
     // onSampleRateChange
     m.lock();
-    while(runningt)
-        cond2.wait(m);
+    waitBlock();
 
     for (Module *module : gModules)
         module->onSampleRateChange();
@@ -12,8 +12,12 @@
 #include "gamepad.hpp"
 #include "osdialog.h"
 #include "util/color.hpp"
+#include "audio.hpp"
+#include "render.hpp"
+#include "bench.hpp"
 
 #include <unistd.h>
+#include <sstream>
 
 
 using namespace rack;
@@ -66,6 +70,101 @@ extern "C" void main2() {
 #endif
 }
 
+#ifndef ARCH_WEB
+/** Usage: Rack --render <patch.vcv> <out.wav> [--seconds N | --frames N] [--sample-rate SR] [--block-size N] */
+static int renderMain(int argc, char* argv[]) {
+	if (argc < 4) {
+		warn("Usage: %s --render <patch.vcv> <out.wav> [--seconds N | --frames N] [--sample-rate SR] [--block-size N]", argv[0]);
+		return 1;
+	}
+	std::string patchPath = argv[2];
+	std::string wavPath = argv[3];
+	float sampleRate = 44100.f;
+	float seconds = 10.f;
+	long frames = -1;
+	int blockSize = 256;
+	for (int i = 4; i + 1 < argc; i += 2) {
+		std::string arg = argv[i];
+		if (arg == "--seconds")
+			seconds = atof(argv[i + 1]);
+		else if (arg == "--frames")
+			frames = atol(argv[i + 1]);
+		else if (arg == "--sample-rate")
+			sampleRate = atof(argv[i + 1]);
+		else if (arg == "--block-size")
+			blockSize = atoi(argv[i + 1]);
+		else
+			warn("Unknown render option %s", arg.c_str());
+	}
+	if (frames < 0)
+		frames = (long) (seconds * sampleRate);
+
+	pluginInit();
+	engineInit();
+	audioSetOffline(true);
+	bool success = renderPatch(patchPath, wavPath, sampleRate, frames, blockSize);
+	engineDestroy();
+	pluginDestroy();
+	loggerDestroy();
+	return success ? 0 : 1;
+}
+
+static std::vector<int> parseIntList(std::string str) {
+	std::vector<int> list;
+	std::stringstream ss(str);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		list.push_back(atoi(item.c_str()));
+	return list;
+}
+
+/** Usage: Rack --bench [--graphs fanout,chain,dag,ring] [--modules N] [--seconds N] [--sample-rate SR] [--block-sizes 16,64,...] [--threads 1,2,...] [--paced 0|1] [--batch 0|1] */
+static int benchMain(int argc, char* argv[]) {
+	BenchOptions options;
+	for (int i = 2; i + 1 < argc; i += 2) {
+		std::string arg = argv[i];
+		if (arg == "--graphs")
+			options.graphs = argv[i + 1];
+		else if (arg == "--modules")
+			options.modules = std::max(atoi(argv[i + 1]), 1);
+		else if (arg == "--seconds")
+			options.seconds = atof(argv[i + 1]);
+		else if (arg == "--sample-rate")
+			options.sampleRate = atof(argv[i + 1]);
+		else if (arg == "--block-sizes")
+			options.blockSizes = parseIntList(argv[i + 1]);
+		else if (arg == "--threads")
+			options.threadCounts = parseIntList(argv[i + 1]);
+		else if (arg == "--paced")
+			options.paced = atoi(argv[i + 1]);
+		else if (arg == "--batch")
+			options.batch = atoi(argv[i + 1]);
+		else
+			warn("Unknown benchmark option %s", arg.c_str());
+	}
+	for (int &blockSize : options.blockSizes)
+		blockSize = clamp(blockSize, 1, 4096);
+
+	engineInit();
+	benchRun(options);
+	engineDestroy();
+	loggerDestroy();
+	return 0;
+}
+#endif
+
+#if ARCH_LIN
+/** Prefixes a relative path with the current working directory */
+static std::string absolutePath(const std::string &path) {
+	if (path.empty() || path[0] == '/')
+		return path;
+	char *cwd = getcwd(NULL, 0);
+	std::string absolute = std::string(cwd) + "/" + path;
+	free(cwd);
+	return absolute;
+}
+#endif
+
 int main(int argc, char* argv[]) {
 	randomInit();
 	assetInit();
@@ -73,6 +172,17 @@ int main(int argc, char* argv[]) {
 
 	info("Rack %s", gApplicationVersion.c_str());
 
+#if ARCH_LIN
+	// The paths given to --render are relative to the caller's working directory, which is changed to the executable's below
+	std::string renderPaths[2];
+	if (argc >= 4 && std::string(argv[1]) == "--render") {
+		for (int i = 0; i < 2; i++) {
+			renderPaths[i] = absolutePath(argv[2 + i]);
+			argv[2 + i] = (char*) renderPaths[i].c_str();
+		}
+	}
+#endif
+
 	{
 #if ARCH_LIN
 	    char *path = realpath("/proc/self/exe", NULL);
@@ -94,6 +204,10 @@ int main(int argc, char* argv[]) {
 	}
 
 #ifndef ARCH_WEB
+	if (argc >= 2 && std::string(argv[1]) == "--render")
+		return renderMain(argc, argv);
+	if (argc >= 2 && std::string(argv[1]) == "--bench")
+		return benchMain(argc, argv);
 	main2();
 #else
 	EM_ASM(
@@ -3,6 +3,7 @@
 #include "bridge.hpp"
 #include "gamepad.hpp"
 #include "keyboard.hpp"
+#include "engine.hpp"
 
 
 namespace rack {
@@ -28,6 +29,9 @@ void MidiInputDevice::unsubscribe(MidiInput *midiInput) {
 }
 
 void MidiInputDevice::onMessage(MidiMessage message) {
+	// A running clock and other system realtime messages don't need low latency, so they don't keep the engine from rendering ahead
+	if (message.cmd < 0xf8)
+		engineNotifyLive();
 	for (MidiInput *midiInput : subscribed) {
 		midiInput->onMessage(message);
 	}
@@ -0,0 +1,230 @@
+#include "render.hpp"
+#include "util/common.hpp"
+#include "engine.hpp"
+#include "plugin.hpp"
+#include "audio.hpp"
+#include <jansson.h>
+#include <chrono>
+
+
+namespace rack {
+
+
+struct HeadlessPatch {
+	std::vector<Module*> modules;
+	std::vector<Wire*> wires;
+};
+
+
+static Module *moduleFromJson(json_t *moduleJ) {
+	json_t *pluginSlugJ = json_object_get(moduleJ, "plugin");
+	json_t *modelSlugJ = json_object_get(moduleJ, "model");
+	if (!pluginSlugJ || !modelSlugJ)
+		return NULL;
+	std::string pluginSlug = json_string_value(pluginSlugJ);
+	std::string modelSlug = json_string_value(modelSlugJ);
+
+	Model *model = pluginGetModel(pluginSlug, modelSlug);
+	if (!model) {
+		warn("Could not find module \"%s\" of plugin \"%s\"", modelSlug.c_str(), pluginSlug.c_str());
+		return NULL;
+	}
+	Module *module = model->createModule();
+	if (!module) {
+		warn("Module \"%s\" of plugin \"%s\" cannot be created without a window", modelSlug.c_str(), pluginSlug.c_str());
+		return NULL;
+	}
+
+	// params
+	json_t *paramsJ = json_object_get(moduleJ, "params");
+	size_t i;
+	json_t *paramJ;
+	json_array_foreach(paramsJ, i, paramJ) {
+		json_t *paramIdJ = json_object_get(paramJ, "paramId");
+		json_t *valueJ = json_object_get(paramJ, "value");
+		if (!paramIdJ || !valueJ)
+			continue;
+		int paramId = json_integer_value(paramIdJ);
+		if (0 <= paramId && paramId < (int) module->params.size())
+			module->params[paramId].value = json_number_value(valueJ);
+	}
+
+	// bypass
+	json_t *bypassJ = json_object_get(moduleJ, "bypass");
+	if (bypassJ)
+		engineSetModuleBypass(module, json_is_true(bypassJ));
+
+	// data
+	json_t *dataJ = json_object_get(moduleJ, "data");
+	if (dataJ)
+		module->fromJson(dataJ);
+
+	module->onCreate();
+	return module;
+}
+
+static bool patchFromJson(HeadlessPatch *patch, json_t *rootJ) {
+	json_t *versionJ = json_object_get(rootJ, "version");
+	std::string version = versionJ ? json_string_value(versionJ) : "";
+	if (stringStartsWith(version, "0.3.") || stringStartsWith(version, "0.4.") || stringStartsWith(version, "0.5.") || version == "" || version == "dev") {
+		warn("Patches created with Rack 0.5 or earlier cannot be rendered, resave it with this version first");
+		return false;
+	}
+
+	// modules, indexed by their position in the array like RackWidget::fromJson()
+	json_t *modulesJ = json_object_get(rootJ, "modules");
+	if (!modulesJ)
+		return false;
+	std::vector<Module*> moduleIds(json_array_size(modulesJ), NULL);
+	size_t moduleId;
+	json_t *moduleJ;
+	json_array_foreach(modulesJ, moduleId, moduleJ) {
+		Module *module = moduleFromJson(moduleJ);
+		if (!module)
+			continue;
+		engineAddModule(module);
+		patch->modules.push_back(module);
+		moduleIds[moduleId] = module;
+	}
+
+	// wires
+	json_t *wiresJ = json_object_get(rootJ, "wires");
+	size_t wireId;
+	json_t *wireJ;
+	json_array_foreach(wiresJ, wireId, wireJ) {
+		int outputModuleId = json_integer_value(json_object_get(wireJ, "outputModuleId"));
+		int outputId = json_integer_value(json_object_get(wireJ, "outputId"));
+		int inputModuleId = json_integer_value(json_object_get(wireJ, "inputModuleId"));
+		int inputId = json_integer_value(json_object_get(wireJ, "inputId"));
+		if (outputModuleId < 0 || outputModuleId >= (int) moduleIds.size() || inputModuleId < 0 || inputModuleId >= (int) moduleIds.size())
+			continue;
+		Module *outputModule = moduleIds[outputModuleId];
+		Module *inputModule = moduleIds[inputModuleId];
+		if (!outputModule || !inputModule)
+			continue;
+		if (outputId < 0 || outputId >= (int) outputModule->outputs.size() || inputId < 0 || inputId >= (int) inputModule->inputs.size())
+			continue;
+		// Skip wires to inputs which are already used, which the engine does not allow
+		bool used = false;
+		for (Wire *wire : patch->wires) {
+			if (wire->inputModule == inputModule && wire->inputId == inputId)
+				used = true;
+		}
+		if (used)
+			continue;
+
+		Wire *wire = new Wire();
+		wire->outputModule = outputModule;
+		wire->outputId = outputId;
+		wire->inputModule = inputModule;
+		wire->inputId = inputId;
+		engineAddWire(wire);
+		patch->wires.push_back(wire);
+	}
+	return true;
+}
+
+static void patchClear(HeadlessPatch *patch) {
+	engineBeginTransaction();
+	for (Wire *wire : patch->wires)
+		engineDeleteWire(wire);
+	patch->wires.clear();
+	for (Module *module : patch->modules)
+		engineDeleteModule(module);
+	patch->modules.clear();
+	engineCommitTransaction();
+}
+
+static void writeU32(FILE *file, uint32_t x) {
+	uint8_t b[4] = {(uint8_t) x, (uint8_t) (x >> 8), (uint8_t) (x >> 16), (uint8_t) (x >> 24)};
+	fwrite(b, 1, 4, file);
+}
+
+static void writeU16(FILE *file, uint16_t x) {
+	uint8_t b[2] = {(uint8_t) x, (uint8_t) (x >> 8)};
+	fwrite(b, 1, 2, file);
+}
+
+/** Writes a WAVE_FORMAT_IEEE_FLOAT header for `frames` frames */
+static void writeWavHeader(FILE *file, int channels, int sampleRate, uint32_t frames) {
+	uint32_t dataSize = frames * channels * 4;
+	fwrite("RIFF", 1, 4, file);
+	writeU32(file, 4 + (8 + 18) + (8 + 4) + (8 + dataSize));
+	fwrite("WAVE", 1, 4, file);
+	fwrite("fmt ", 1, 4, file);
+	writeU32(file, 18);
+	writeU16(file, 3);
+	writeU16(file, channels);
+	writeU32(file, sampleRate);
+	writeU32(file, sampleRate * channels * 4);
+	writeU16(file, channels * 4);
+	writeU16(file, 32);
+	writeU16(file, 0);
+	fwrite("fact", 1, 4, file);
+	writeU32(file, 4);
+	writeU32(file, frames);
+	fwrite("data", 1, 4, file);
+	writeU32(file, dataSize);
+}
+
+bool renderPatch(std::string patchPath, std::string wavPath, float sampleRate, long frames, int blockSize) {
+	info("Rendering patch %s to %s", patchPath.c_str(), wavPath.c_str());
+	const int channels = 2;
+	blockSize = clamp(blockSize, 1, 4096);
+	engineSetSampleRate(sampleRate);
+
+	FILE *patchFile = fopen(patchPath.c_str(), "r");
+	if (!patchFile) {
+		warn("Could not open patch %s", patchPath.c_str());
+		return false;
+	}
+	json_error_t error;
+	json_t *rootJ = json_loadf(patchFile, 0, &error);
+	fclose(patchFile);
+	if (!rootJ) {
+		warn("JSON parsing error at %s %d:%d %s", error.source, error.line, error.column, error.text);
+		return false;
+	}
+
+	HeadlessPatch patch;
+	engineBeginTransaction();
+	bool loaded = patchFromJson(&patch, rootJ);
+	engineCommitTransaction();
+	json_decref(rootJ);
+	defer({
+		patchClear(&patch);
+	});
+	if (!loaded)
+		return false;
+
+	FILE *wavFile = fopen(wavPath.c_str(), "wb");
+	if (!wavFile) {
+		warn("Could not open %s for writing", wavPath.c_str());
+		return false;
+	}
+	writeWavHeader(wavFile, channels, sampleRate, frames);
+
+	std::vector<float> buffer(blockSize * channels);
+	auto startTime = std::chrono::high_resolution_clock::now();
+	// The audio interface outputs the previous block, so the first block is silence and is dropped
+	if (!audioProcessOffline(buffer.data(), blockSize)) {
+		warn("Patch has no audio interface to render");
+		fclose(wavFile);
+		return false;
+	}
+	for (long frame = 0; frame < frames; frame += blockSize) {
+		audioProcessOffline(buffer.data(), blockSize);
+		long n = std::min((long) blockSize, frames - frame);
+		fwrite(buffer.data(), sizeof(float), n * channels, wavFile);
+	}
+	// Let the last block finish before the patch is cleared
+	engineWaitMT();
+	fclose(wavFile);
+
+	double duration = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - startTime).count();
+	info("Rendered %ld frames in %.3f s, %.1fx realtime", frames, duration, frames / sampleRate / duration);
+	return true;
+}
+
+
+} // namespace rack
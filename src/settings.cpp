@@ -15,6 +15,7 @@ bool skipAutosaveOnLaunch = false;
 bool largerHitBoxes = false;
 bool lockModules = false;
 float knobSensitivity = KNOB_SENSITIVITY;
+int threadCount = 0;
 
 std::string lastDialogPath = assetLocal("");
 
@@ -88,6 +89,41 @@ static json_t *settingsToJson() {
 	// knobSensitivity
 	json_object_set_new(rootJ, "knobSensitivity", json_real(knobSensitivity));
 
+	// threadCount
+	if (threadCount > 0)
+		json_object_set_new(rootJ, "threadCount", json_integer(threadCount));
+
+	EngineThreadConfig threadConfig = engineGetThreadConfig();
+	// threadPolicy
+	const char *threadPolicy = "rr";
+	if (threadConfig.policy == EngineThreadConfig::POLICY_FIFO)
+		threadPolicy = "fifo";
+	else if (threadConfig.policy == EngineThreadConfig::POLICY_OTHER)
+		threadPolicy = "other";
+	json_object_set_new(rootJ, "threadPolicy", json_string(threadPolicy));
+
+	// threadPriority
+	json_object_set_new(rootJ, "threadPriority", json_integer(threadConfig.priority));
+
+	// threadCpuMasks
+	if (!threadConfig.cpuMasks.empty()) {
+		json_t *cpuMasksJ = json_array();
+		for (uint64_t mask : threadConfig.cpuMasks)
+			json_array_append_new(cpuMasksJ, json_integer(mask));
+		json_object_set_new(rootJ, "threadCpuMasks", cpuMasksJ);
+	}
+
+	// lockMemory
+	if (threadConfig.lockMemory)
+		json_object_set_new(rootJ, "lockMemory", json_true());
+
+	// prefault
+	if (threadConfig.prefault)
+		json_object_set_new(rootJ, "prefault", json_true());
+
+	// threadSpinTime
+	json_object_set_new(rootJ, "threadSpinTime", json_real(threadConfig.spinTime));
+
 	return rootJ;
 }
 
@@ -182,6 +218,59 @@ static void settingsFromJson(json_t *rootJ) {
 		knobSensitivity = json_number_value(knobSensitivityJ);
 	else
 		knobSensitivity = KNOB_SENSITIVITY;
+
+	// threadCount
+	json_t *threadCountJ = json_object_get(rootJ, "threadCount");
+	int newThreadCount = threadCountJ ? json_integer_value(threadCountJ) : 0;
+	if (newThreadCount != threadCount) {
+		threadCount = newThreadCount;
+		engineSetThreadCount(threadCount);
+	}
+
+	EngineThreadConfig threadConfig;
+	// threadPolicy
+	json_t *threadPolicyJ = json_object_get(rootJ, "threadPolicy");
+	if (json_is_string(threadPolicyJ)) {
+		std::string threadPolicy = json_string_value(threadPolicyJ);
+		if (threadPolicy == "fifo")
+			threadConfig.policy = EngineThreadConfig::POLICY_FIFO;
+		else if (threadPolicy == "other")
+			threadConfig.policy = EngineThreadConfig::POLICY_OTHER;
+	}
+
+	// threadPriority
+	json_t *threadPriorityJ = json_object_get(rootJ, "threadPriority");
+	if (threadPriorityJ)
+		threadConfig.priority = json_integer_value(threadPriorityJ);
+
+	// threadCpuMasks
+	json_t *cpuMasksJ = json_object_get(rootJ, "threadCpuMasks");
+	if (cpuMasksJ) {
+		size_t i;
+		json_t *maskJ;
+		json_array_foreach(cpuMasksJ, i, maskJ) {
+			threadConfig.cpuMasks.push_back(json_integer_value(maskJ));
+		}
+	}
+
+	// lockMemory
+	json_t *lockMemoryJ = json_object_get(rootJ, "lockMemory");
+	if (lockMemoryJ)
+		threadConfig.lockMemory = json_boolean_value(lockMemoryJ);
+
+	// prefault
+	json_t *prefaultJ = json_object_get(rootJ, "prefault");
+	if (prefaultJ)
+		threadConfig.prefault = json_boolean_value(prefaultJ);
+
+	// threadSpinTime
+	json_t *threadSpinTimeJ = json_object_get(rootJ, "threadSpinTime");
+	if (threadSpinTimeJ)
+		threadConfig.spinTime = json_number_value(threadSpinTimeJ);
+
+	// Restarting the workers interrupts the audio, so only do it if something changed
+	if (threadConfig != engineGetThreadConfig())
+		engineSetThreadConfig(threadConfig);
 }
 
 